@@ -0,0 +1,558 @@
+/* omxbench.cpp
+ *
+ * Benchmarks of OMX writing and reading on synthetic matrices, across a
+ * grid of chunk shapes and deflate levels, with results as JSON so runs
+ * can be compared from release to release.
+ *
+ * For every chunk shape and deflate level it times:
+ *
+ *   write_row      OMXMatrix::writeRow() of every row, one at a time
+ *   copy_write     copy_data() from memory into a new OMX file
+ *   get_row        OMXMatrix::getRow() of every row, one at a time
+ *   copy_read      copy_data() from that file back into memory
+ *   lookup_batch   random cells with getValues(), one call per table
+ *   lookup_single  the same cells with getValue(), one at a time
+ *
+ * Each is run -repeat times; the best time counts and the mean is kept
+ * too.  Reads and lookups open the file afresh every run, so they start
+ * with a cold chunk cache (but, of course, not a cold OS file cache).
+ *
+ * Build with "make bench"; "omxbench -help" lists the options.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "../memmatrix.h"
+#include "../omxmatrix.h"
+#include "../pipeline.h"
+#include "synthetic.h"
+
+using namespace std;
+
+// One timed operation, over all its runs
+struct Timing {
+    double   best;
+    double   total;
+    int      runs;
+
+    Timing() : best(0), total(0), runs(0) {}
+
+    void     add(double seconds) {
+        if (runs == 0 || seconds < best) best = seconds;
+        total += seconds;
+        runs++;
+    }
+    double   mean() { return runs > 0 ? total / runs : 0; }
+};
+
+// Everything measured at one grid point
+struct GridResult {
+    string   chunk;        // as given
+    int      chunkRows;    // as created
+    int      chunkCols;
+    int      deflate;
+    bool     shuffle;
+    long long fileBytes;
+
+    Timing   writeRow, copyWrite, getRow, copyRead, lookupBatch, lookupSingle;
+};
+
+struct Lookup {
+    int      table;
+    int      row;
+    int      col;
+};
+
+SyntheticSpec _spec;
+vector<string> _chunks;
+vector<int> _deflates;
+bool _shuffle = false;
+int _threads = 0;
+int _lookups = 100000;
+int _repeat = 1;
+string _dir = ".";
+bool _keep = false;
+char* _jsonFile = (char *) "omxbench.json";
+char* _generate = NULL;
+PipelineOptions _pipeline;
+
+void usage();
+bool parseOption(int argc, char* argv[], int &i);
+bool applyChunk(string chunk, OMXWriteOptions &options);
+int generate(char *filename);
+void runGrid(MemMatrix &mem, vector<Lookup> &lookups, OMXWriteOptions &options, GridResult &res);
+void writeJson(FILE *f, vector<GridResult> &results);
+
+static double now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i=1; i<argc; i++) {
+        if (!parseOption(argc, argv, i)) {
+            fprintf(stderr, "\n** Unknown option %s\n", argv[i]);
+            usage();
+            exit(2);
+        }
+    }
+
+    cout << "\nOMX Benchmarks (built " << __DATE__ << " " << __TIME__ << ")\n";
+
+    if (_chunks.empty()) {
+        _chunks.push_back("1,0");
+        _chunks.push_back("auto");
+        _chunks.push_back("tile");
+    }
+    if (_deflates.empty()) {
+        _deflates.push_back(0);
+        _deflates.push_back(1);
+        _deflates.push_back(7);
+    }
+    for (unsigned int c=0; c<_chunks.size(); c++) {
+        OMXWriteOptions check;
+        if (!applyChunk(_chunks[c], check)) {
+            fprintf(stderr, "\n** Bad chunk shape %s; use rows,cols, auto or tile\n", _chunks[c].c_str());
+            exit(2);
+        }
+    }
+
+    if (_generate != NULL) return generate(_generate);
+
+    // The source matrix, in memory so generating it isn't timed
+    printf("\nGenerating %d tables of %d zones (%s, sparsity %g)...\n", _spec.tables, _spec.zones,
+           SyntheticSpec::distributionName(_spec.distribution), _spec.sparsity);
+    SyntheticMatrix synth(_spec);
+    vector<string> names;
+    for (int t=1; t<=_spec.tables; t++) names.push_back(synth.getTableName(t));
+
+    MemMatrix mem;
+    mem.create(_spec.tables, _spec.zones, names);
+    double *row = synth.allocateRowBuffer();
+    for (int r=1; r<=_spec.zones; r++) {
+        for (int t=1; t<=_spec.tables; t++) {
+            synth.getRow(t, r, row);
+            mem.writeRow(t, r, row);
+        }
+    }
+    free(row);
+
+    // The same random cells for every grid point
+    vector<Lookup> lookups(_lookups);
+    mt19937_64 rng(_spec.seed);
+    for (int i=0; i<_lookups; i++) {
+        lookups[i].table = 1 + (int)(rng() % _spec.tables);
+        lookups[i].row = 1 + (int)(rng() % _spec.zones);
+        lookups[i].col = 1 + (int)(rng() % _spec.zones);
+    }
+
+    vector<GridResult> results;
+    for (unsigned int c=0; c<_chunks.size(); c++) {
+        for (unsigned int d=0; d<_deflates.size(); d++) {
+            OMXWriteOptions options;
+            applyChunk(_chunks[c], options);
+            options.deflate = _deflates[d];
+            options.shuffle = _shuffle && options.deflate > 0;
+            options.threads = _threads;
+
+            GridResult res;
+            res.chunk = _chunks[c];
+            res.deflate = options.deflate;
+            res.shuffle = options.shuffle;
+
+            printf("\n## chunk %s, deflate %d%s\n", res.chunk.c_str(), res.deflate,
+                   res.shuffle ? ", shuffle" : "");
+            runGrid(mem, lookups, options, res);
+            results.push_back(res);
+        }
+    }
+
+    FILE *f = fopen(_jsonFile, "w");
+    if (f == NULL) {
+        fprintf(stderr, "\n** Can't write %s\n", _jsonFile);
+        exit(2);
+    }
+    writeJson(f, results);
+    fclose(f);
+
+    // And the gist of it on screen
+    double mb = (double)_spec.zones * _spec.zones * _spec.tables * sizeof(double) / 1e6;
+    printf("\n%-10s %7s %10s %9s %9s %9s %9s %11s %11s\n", "chunk", "deflate", "file MB", "writeRow",
+           "copyW", "getRow", "copyR", "batch/s", "single/s");
+    for (unsigned int i=0; i<results.size(); i++) {
+        GridResult &res = results[i];
+        printf("%-10s %6d%s %10.1f %8.3fs %8.3fs %8.3fs %8.3fs %11.0f %11.0f\n", res.chunk.c_str(),
+               res.deflate, res.shuffle ? "s" : " ", res.fileBytes / 1e6, res.writeRow.best,
+               res.copyWrite.best, res.getRow.best, res.copyRead.best,
+               _lookups / res.lookupBatch.best, _lookups / res.lookupSingle.best);
+    }
+    printf("\n%.1f MB of values per grid point; results in %s\n", mb, _jsonFile);
+    return 0;
+}
+
+void usage() {
+    cout << "\nUsage: omxbench [options]\n\n";
+    cout << "Times OMX writes, reads and cell lookups on a synthetic matrix for every\n";
+    cout << "combination of chunk shape and deflate level, and writes the results as JSON.\n\n";
+    cout << "Without options it runs the default grid on a 1500-zone skim matrix.\n\n";
+    cout << "Matrix options:\n";
+    cout << "   -zones N         Zones (default 1500)\n";
+    cout << "   -tables N        Tables (default 4)\n";
+    cout << "   -dist NAME       Values: uniform, lognormal, skim or counts (default skim)\n";
+    cout << "   -sparsity S      Share of cells set to zero, 0-1 (default 0)\n";
+    cout << "   -seed N          Random seed (default 1)\n";
+    cout << "Grid options:\n";
+    cout << "   -chunk SPEC      Chunk shape rows,cols (0 cols = full rows), auto or tile\n";
+    cout << "                    (auto for tile access); repeat for more (default 1,0,\n";
+    cout << "                    auto and tile)\n";
+    cout << "   -deflate L,L..   Deflate levels (default 0,1,7)\n";
+    cout << "   -shuffle         Byte-shuffle ahead of deflate\n";
+    cout << "   -threads N       Compression threads, as for cube2omx\n";
+    cout << "   -nopipeline      Run copy_data() stages on one thread\n";
+    cout << "Run options:\n";
+    cout << "   -lookups N       Random cells looked up (default 100000)\n";
+    cout << "   -repeat N        Runs of each measurement; the best counts (default 1)\n";
+    cout << "   -dir DIR         Where to write the OMX files (default .)\n";
+    cout << "   -keep            Keep the OMX files, as omxbench-<n>.omx\n";
+    cout << "   -json FILE       Results file (default omxbench.json)\n";
+    cout << "   -generate FILE   Just write the synthetic matrix to FILE (.omx, using the\n";
+    cout << "                    first chunk shape and deflate level, or raw) and exit\n";
+}
+
+char* optionValue(int argc, char* argv[], int &i) {
+    if (i+1 >= argc) {
+        fprintf(stderr, "\n** Option %s needs a value\n", argv[i]);
+        exit(2);
+    }
+    return argv[++i];
+}
+
+int positiveValue(int argc, char* argv[], int &i) {
+    char *opt = argv[i];
+    int value = atoi(optionValue(argc, argv, i));
+    if (value < 1) {
+        fprintf(stderr, "\n** %s must be at least 1\n", opt);
+        exit(2);
+    }
+    return value;
+}
+
+bool parseOption(int argc, char* argv[], int &i) {
+    char *opt = argv[i];
+
+    if (strcmp(opt, "-help")==0) {
+        usage();
+        exit(0);
+
+    } else if (strcmp(opt, "-zones")==0) {
+        _spec.zones = positiveValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-tables")==0) {
+        _spec.tables = positiveValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-dist")==0) {
+        char *value = optionValue(argc, argv, i);
+        if (!SyntheticSpec::parseDistribution(value, _spec.distribution)) {
+            fprintf(stderr, "\n** Bad distribution %s; use uniform, lognormal, skim or counts\n", value);
+            exit(2);
+        }
+
+    } else if (strcmp(opt, "-sparsity")==0) {
+        _spec.sparsity = atof(optionValue(argc, argv, i));
+        if (_spec.sparsity < 0 || _spec.sparsity > 1) {
+            fprintf(stderr, "\n** Sparsity must be 0-1\n");
+            exit(2);
+        }
+
+    } else if (strcmp(opt, "-seed")==0) {
+        _spec.seed = (unsigned int) atol(optionValue(argc, argv, i));
+
+    } else if (strcmp(opt, "-chunk")==0) {
+        _chunks.push_back(optionValue(argc, argv, i));
+
+    } else if (strcmp(opt, "-deflate")==0) {
+        char *value = optionValue(argc, argv, i);
+        for (char *p = strtok(value, ","); p != NULL; p = strtok(NULL, ",")) {
+            int level = atoi(p);
+            if (level < 0 || level > 9) {
+                fprintf(stderr, "\n** Deflate level must be 0-9\n");
+                exit(2);
+            }
+            _deflates.push_back(level);
+        }
+
+    } else if (strcmp(opt, "-shuffle")==0) {
+        _shuffle = true;
+
+    } else if (strcmp(opt, "-threads")==0) {
+        _threads = atoi(optionValue(argc, argv, i));
+
+    } else if (strcmp(opt, "-nopipeline")==0) {
+        _pipeline.threaded = false;
+
+    } else if (strcmp(opt, "-lookups")==0) {
+        _lookups = positiveValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-repeat")==0) {
+        _repeat = positiveValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-dir")==0) {
+        _dir = optionValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-keep")==0) {
+        _keep = true;
+
+    } else if (strcmp(opt, "-json")==0) {
+        _jsonFile = optionValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-generate")==0) {
+        _generate = optionValue(argc, argv, i);
+
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Chunk shape as for cube2omx -chunk, plus "tile": auto for tile access
+bool applyChunk(string chunk, OMXWriteOptions &options) {
+    if (chunk == "auto" || chunk == "tile") {
+        options.autoChunk = true;
+        options.access = chunk == "tile" ? ACCESS_TILE : ACCESS_ROW;
+        return true;
+    }
+    options.autoChunk = false;
+    return 2 == sscanf(chunk.c_str(), "%d,%d", &options.chunkRows, &options.chunkCols) &&
+           options.chunkRows > 0 && options.chunkCols >= 0;
+}
+
+// ###########################################################################
+// Writing the synthetic matrix as a file of its own
+// ---------------------------------------------------------------------------
+
+int generate(char *filename) {
+    SyntheticMatrix synth(_spec);
+    vector<string> names;
+    vector<int> order;
+    for (int t=1; t<=_spec.tables; t++) {
+        names.push_back(synth.getTableName(t));
+        order.push_back(t);
+    }
+
+    int len = strlen(filename);
+    bool omx = len > 4 && strcmp(filename + len - 4, ".omx")==0;
+    printf("\nWriting %d tables of %d zones (%s, sparsity %g) to %s:\n", _spec.tables, _spec.zones,
+           SyntheticSpec::distributionName(_spec.distribution), _spec.sparsity, filename);
+
+    int rtn;
+    if (omx) {
+        OMXWriteOptions options;
+        applyChunk(_chunks[0], options);
+        options.deflate = _deflates[0];
+        options.shuffle = _shuffle && options.deflate > 0;
+        options.threads = _threads;
+
+        OMXMatrix omx;
+        omx.setWriteOptions(options);
+        omx.createFile(_spec.tables, _spec.zones, _spec.zones, names, filename);
+        rtn = copy_data(&synth, &omx, _spec.zones, _spec.tables, order, _pipeline);
+        omx.closeFile();
+    } else {
+        MemMatrix raw;
+        raw.createFile(_spec.tables, _spec.zones, names, filename);
+        rtn = copy_data(&synth, &raw, _spec.zones, _spec.tables, order, _pipeline);
+        raw.closeFile();
+    }
+    return rtn;
+}
+
+// ###########################################################################
+// One grid point
+// ---------------------------------------------------------------------------
+
+static long long fileSize(string path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return 0;
+    return (long long) st.st_size;
+}
+
+static void benchWriteRow(MemMatrix &mem, vector<string> &names, OMXWriteOptions &options,
+                          string path, Timing &timing) {
+    double *row = mem.allocateRowBuffer();
+    double start = now();
+
+    OMXMatrix omx;
+    omx.setWriteOptions(options);
+    omx.createFile(_spec.tables, _spec.zones, _spec.zones, names, path);
+    for (int r=1; r<=_spec.zones; r++) {
+        for (int t=1; t<=_spec.tables; t++) {
+            mem.getRow(t, r, row);
+            omx.writeRow(t, r, row);
+        }
+    }
+    omx.closeFile();
+
+    timing.add(now() - start);
+    free(row);
+}
+
+static void benchCopyWrite(MemMatrix &mem, vector<string> &names, OMXWriteOptions &options,
+                           string path, Timing &timing) {
+    vector<int> order;
+    for (int t=1; t<=_spec.tables; t++) order.push_back(t);
+    double start = now();
+
+    OMXMatrix omx;
+    omx.setWriteOptions(options);
+    omx.createFile(_spec.tables, _spec.zones, _spec.zones, names, path);
+    copy_data(&mem, &omx, _spec.zones, _spec.tables, order, _pipeline);
+    omx.closeFile();
+
+    timing.add(now() - start);
+}
+
+static void benchGetRow(string path, Timing &timing) {
+    double start = now();
+
+    OMXMatrix omx;
+    omx.openFile(path);
+    double *row = omx.allocateRowBuffer();
+    for (int r=1; r<=_spec.zones; r++) {
+        for (int t=1; t<=_spec.tables; t++) omx.getRow(t, r, row);
+    }
+    omx.closeFile();
+
+    timing.add(now() - start);
+    free(row);
+}
+
+static void benchCopyRead(string path, vector<string> &names, Timing &timing) {
+    vector<int> order;
+    for (int t=1; t<=_spec.tables; t++) order.push_back(t);
+    MemMatrix mem;
+    mem.create(_spec.tables, _spec.zones, names);
+    double start = now();
+
+    OMXMatrix omx;
+    omx.openFile(path);
+    copy_data(&omx, &mem, _spec.zones, _spec.tables, order, _pipeline);
+    omx.closeFile();
+
+    timing.add(now() - start);
+}
+
+static void benchLookupBatch(string path, vector<Lookup> &lookups, Timing &timing) {
+    vector< vector< pair<int,int> > > cells(_spec.tables + 1);
+    for (unsigned int i=0; i<lookups.size(); i++) {
+        cells[lookups[i].table].push_back(make_pair(lookups[i].row, lookups[i].col));
+    }
+    vector<double> values(lookups.size());
+    double start = now();
+
+    OMXMatrix omx;
+    omx.openFile(path);
+    for (int t=1; t<=_spec.tables; t++) {
+        if (!cells[t].empty()) omx.getValues(t, cells[t], &values[0]);
+    }
+    omx.closeFile();
+
+    timing.add(now() - start);
+}
+
+static void benchLookupSingle(string path, vector<Lookup> &lookups, Timing &timing) {
+    double start = now();
+
+    OMXMatrix omx;
+    omx.openFile(path);
+    for (unsigned int i=0; i<lookups.size(); i++) {
+        omx.getValue(lookups[i].table, lookups[i].row, lookups[i].col);
+    }
+    omx.closeFile();
+
+    timing.add(now() - start);
+}
+
+void runGrid(MemMatrix &mem, vector<Lookup> &lookups, OMXWriteOptions &options, GridResult &res) {
+    static int point = 0;
+    char name[32];
+    sprintf(name, "/omxbench-%d.omx", ++point);
+    string path = _dir + name;
+
+    vector<string> names;
+    for (int t=1; t<=_spec.tables; t++) names.push_back(mem.getTableName(t));
+
+    for (int i=0; i<_repeat; i++) benchWriteRow(mem, names, options, path, res.writeRow);
+    for (int i=0; i<_repeat; i++) benchCopyWrite(mem, names, options, path, res.copyWrite);
+    res.fileBytes = fileSize(path);
+
+    OMXMatrix omx;
+    omx.openFile(path);
+    omx.getTileShape(1, res.chunkRows, res.chunkCols);
+    omx.closeFile();
+
+    for (int i=0; i<_repeat; i++) benchGetRow(path, res.getRow);
+    for (int i=0; i<_repeat; i++) benchCopyRead(path, names, res.copyRead);
+    for (int i=0; i<_repeat; i++) benchLookupBatch(path, lookups, res.lookupBatch);
+    for (int i=0; i<_repeat; i++) benchLookupSingle(path, lookups, res.lookupSingle);
+
+    if (!_keep) remove(path.c_str());
+}
+
+// ###########################################################################
+// JSON results
+// ---------------------------------------------------------------------------
+
+static void writeTiming(FILE *f, const char *name, Timing &timing, const char *rateName,
+                        double units, bool last) {
+    fprintf(f, "      \"%s\": {\"seconds\": %.6f, \"mean_seconds\": %.6f, \"runs\": %d, \"%s\": %.3f}%s\n",
+            name, timing.best, timing.mean(), timing.runs, rateName,
+            timing.best > 0 ? units / timing.best : 0, last ? "" : ",");
+}
+
+void writeJson(FILE *f, vector<GridResult> &results) {
+    unsigned int major, minor, release;
+    H5get_libversion(&major, &minor, &release);
+    double mb = (double)_spec.zones * _spec.zones * _spec.tables * sizeof(double) / 1e6;
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"benchmark\": \"omxbench\",\n");
+    fprintf(f, "  \"built\": \"%s %s\",\n", __DATE__, __TIME__);
+    fprintf(f, "  \"hdf5\": \"%u.%u.%u\",\n", major, minor, release);
+    fprintf(f, "  \"matrix\": {\"zones\": %d, \"tables\": %d, \"distribution\": \"%s\", "
+               "\"sparsity\": %g, \"seed\": %u, \"mb\": %.3f},\n", _spec.zones, _spec.tables,
+            SyntheticSpec::distributionName(_spec.distribution), _spec.sparsity, _spec.seed, mb);
+    fprintf(f, "  \"settings\": {\"threads\": %d, \"pipelined\": %s, \"depth\": %d, "
+               "\"lookups\": %d, \"repeat\": %d},\n", _threads, _pipeline.threaded ? "true" : "false",
+            _pipeline.depth, _lookups, _repeat);
+    fprintf(f, "  \"results\": [\n");
+
+    for (unsigned int i=0; i<results.size(); i++) {
+        GridResult &res = results[i];
+        fprintf(f, "    {\n");
+        fprintf(f, "      \"chunk\": \"%s\", \"chunk_rows\": %d, \"chunk_cols\": %d,\n",
+                res.chunk.c_str(), res.chunkRows, res.chunkCols);
+        fprintf(f, "      \"deflate\": %d, \"shuffle\": %s,\n", res.deflate, res.shuffle ? "true" : "false");
+        fprintf(f, "      \"file_bytes\": %lld, \"ratio\": %.4f,\n", res.fileBytes,
+                res.fileBytes > 0 ? mb * 1e6 / res.fileBytes : 0);
+        writeTiming(f, "write_row", res.writeRow, "mb_per_s", mb, false);
+        writeTiming(f, "copy_write", res.copyWrite, "mb_per_s", mb, false);
+        writeTiming(f, "get_row", res.getRow, "mb_per_s", mb, false);
+        writeTiming(f, "copy_read", res.copyRead, "mb_per_s", mb, false);
+        writeTiming(f, "lookup_batch", res.lookupBatch, "cells_per_s", _lookups, false);
+        writeTiming(f, "lookup_single", res.lookupSingle, "cells_per_s", _lookups, true);
+        fprintf(f, "    }%s\n", i+1 < results.size() ? "," : "");
+    }
+
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+}
@@ -0,0 +1,108 @@
+/* synthetic.cpp
+ *
+ * Generated matrices with realistic value distributions.
+ *
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "synthetic.h"
+
+using namespace std;
+
+static const char* _distNames[] = { "uniform", "lognormal", "skim", "counts" };
+
+bool SyntheticSpec::parseDistribution(const char *name, int &distribution) {
+    for (int i=0; i<4; i++) {
+        if (strcmp(name, _distNames[i])==0) {
+            distribution = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* SyntheticSpec::distributionName(int distribution) {
+    return distribution >= 0 && distribution < 4 ? _distNames[distribution] : "?";
+}
+
+// ###########################################################################
+// SyntheticMatrix:  rows generated on demand
+// ---------------------------------------------------------------------------
+
+SyntheticMatrix::SyntheticMatrix(SyntheticSpec &spec) {
+    _spec = spec;
+
+    // Zones scattered over a 1 x 1 region
+    mt19937_64 rng(spec.seed);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    _x.resize(spec.zones);
+    _y.resize(spec.zones);
+    for (int i=0; i<spec.zones; i++) {
+        _x[i] = unit(rng);
+        _y[i] = unit(rng);
+    }
+}
+
+int SyntheticMatrix::getZones() {
+    return _spec.zones;
+}
+
+int SyntheticMatrix::getTables() {
+    return _spec.tables;
+}
+
+string SyntheticMatrix::getTableName(int table) {
+    char name[16];
+    sprintf(name, "T%d", table);
+    return name;
+}
+
+void SyntheticMatrix::getRow(int table, int row, double *rowptr) {
+    seed_seq seq = { _spec.seed, (unsigned int) table, (unsigned int) row };
+    mt19937_64 rng(seq);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    int n = _spec.zones;
+
+    switch (_spec.distribution) {
+    case DIST_UNIFORM:
+        for (int j=0; j<n; j++) rowptr[j] = 100 * unit(rng);
+        break;
+
+    case DIST_LOGNORMAL: {
+        lognormal_distribution<double> trips(-1.0, 1.5);
+        for (int j=0; j<n; j++) rowptr[j] = trips(rng);
+        break;
+    }
+
+    case DIST_SKIM: {
+        // Minutes at a table-specific speed; intrazonal cells get a
+        // small positive time like real skims do
+        double perUnit = 60.0 / (table + 1);
+        normal_distribution<double> noise(1.0, 0.02);
+        for (int j=0; j<n; j++) {
+            double dx = _x[row-1] - _x[j];
+            double dy = _y[row-1] - _y[j];
+            rowptr[j] = (sqrt(dx*dx + dy*dy) + 0.005) * perUnit * noise(rng);
+        }
+        break;
+    }
+
+    case DIST_COUNTS: {
+        poisson_distribution<int> counts(1.5);
+        for (int j=0; j<n; j++) rowptr[j] = counts(rng);
+        break;
+    }
+    }
+
+    if (_spec.sparsity > 0) {
+        for (int j=0; j<n; j++) {
+            if (unit(rng) < _spec.sparsity) rowptr[j] = 0;
+        }
+    }
+}
+
+void SyntheticMatrix::closeFile() {
+}
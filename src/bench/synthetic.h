@@ -0,0 +1,64 @@
+/* synthetic.h
+ *
+ * Synthetic matrices for benchmarks and tests, so nobody has to ship real
+ * model outputs around.
+ *
+ * Every row is generated from its own seed (seed, table, row), so rows can
+ * be read in any order, and again, and always come out the same.  Values
+ * follow one of a few distributions that resemble real tables:
+ *
+ *   uniform    uniform 0-100, the worst case for compression
+ *   lognormal  skewed, mostly small values and a few large ones: trips
+ *   skim       distance between random zone coordinates, plus a little
+ *              noise: times and costs, smooth and highly compressible
+ *   counts     small integers, Poisson-like: person or vehicle counts
+ *
+ * A sparsity s in 0-1 sets that share of cells, at random, to zero.
+ */
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../matrixio.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#define  DIST_UNIFORM    0
+#define  DIST_LOGNORMAL  1
+#define  DIST_SKIM       2
+#define  DIST_COUNTS     3
+
+struct SyntheticSpec {
+    int      zones;
+    int      tables;
+    double   sparsity;     // share of cells set to zero
+    int      distribution; // DIST_*
+    unsigned int seed;
+
+    SyntheticSpec() : zones(1500), tables(4), sparsity(0), distribution(DIST_SKIM), seed(1) {}
+
+    static bool parseDistribution(const char *name, int &distribution);
+    static const char* distributionName(int distribution);
+};
+
+class SyntheticMatrix : public MatrixSource {
+public:
+    SyntheticMatrix(SyntheticSpec &spec);
+
+    int      getZones();
+    int      getTables();
+    string   getTableName(int table);       // T1, T2, ...
+    void     getRow(int table, int row, double *rowptr);
+    void     closeFile();
+
+private:
+    SyntheticSpec _spec;
+    vector<double> _x;              // zone coordinates, for DIST_SKIM
+    vector<double> _y;
+};
+
+#endif /* SYNTHETIC_H */
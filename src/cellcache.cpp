@@ -0,0 +1,128 @@
+/* cellcache.cpp
+ *
+ * Random access to single cells of a matrix, with an LRU cache of
+ * decoded tiles.
+ *
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "cellcache.h"
+
+using namespace std;
+
+CellCache::CellCache(MatrixSource *source, size_t maxBytes) {
+    _source = source;
+    _maxBytes = maxBytes;
+    _bytes = 0;
+    _tileReads = 0;
+}
+
+void CellCache::clear() {
+    _tiles.clear();
+    _index.clear();
+    _bytes = 0;
+}
+
+long long CellCache::getTileReads() {
+    return _tileReads;
+}
+
+double CellCache::getValue(int table, int row, int col) {
+    if (row < 1 || row > _source->getZones() || col < 1 || col > _source->getCols()) return NAN;
+
+    Tile &tile = fetch(table, row, col);
+    return tile.data[(size_t)(row - tile.firstRow) * tile.nCols + (col - tile.firstCol)];
+}
+
+void CellCache::getValues(int table, vector< pair<int,int> > &cells, double *values) {
+    int rows = _source->getZones();
+    int cols = _source->getCols();
+
+    // Visit the cells tile by tile, so no tile is read twice in one batch
+    vector< pair<long long,int> > order;
+    order.reserve(cells.size());
+    for (unsigned int i=0; i<cells.size(); i++) {
+        int row = cells[i].first, col = cells[i].second;
+        if (row < 1 || row > rows || col < 1 || col > cols) {
+            values[i] = NAN;
+            continue;
+        }
+        order.push_back(make_pair(tileKey(table, row, col), (int)i));
+    }
+    sort(order.begin(), order.end());
+
+    Tile *tile = NULL;
+    for (unsigned int k=0; k<order.size(); k++) {
+        int i = order[k].second;
+        int row = cells[i].first, col = cells[i].second;
+
+        if (tile == NULL || tile->key != order[k].first) tile = &fetch(table, row, col);
+        values[i] = tile->data[(size_t)(row - tile->firstRow) * tile->nCols + (col - tile->firstCol)];
+    }
+}
+
+// ---- Private functions ---------------------------------------------------
+
+pair<int,int> CellCache::tileShape(int table) {
+    map<int, pair<int,int> >::iterator it = _shape.find(table);
+    if (it != _shape.end()) return it->second;
+
+    int rows, cols;
+    _source->getTileShape(table, rows, cols);
+    if (rows < 1) rows = 1;
+    if (cols < 1) cols = _source->getCols();
+
+    _shape[table] = make_pair(rows, cols);
+    return _shape[table];
+}
+
+long long CellCache::tileKey(int table, int row, int col) {
+    pair<int,int> shape = tileShape(table);
+    long long tileRow = (row-1) / shape.first;
+    long long tileCol = (col-1) / shape.second;
+    return ((long long)table << 42) | (tileRow << 21) | tileCol;
+}
+
+// The tile holding (row, col), from the cache or read from the source
+CellCache::Tile& CellCache::fetch(int table, int row, int col) {
+    long long key = tileKey(table, row, col);
+
+    map<long long, list<Tile>::iterator>::iterator it = _index.find(key);
+    if (it != _index.end()) {
+        _tiles.splice(_tiles.begin(), _tiles, it->second);
+        return _tiles.front();
+    }
+
+    pair<int,int> shape = tileShape(table);
+    int firstRow = (row-1) / shape.first * shape.first + 1;
+    int firstCol = (col-1) / shape.second * shape.second + 1;
+    int nRows = min(shape.first, _source->getZones() - firstRow + 1);
+    int nCols = min(shape.second, _source->getCols() - firstCol + 1);
+
+    // Make room, always keeping at least the new tile
+    size_t bytes = (size_t)nRows * nCols * sizeof(double);
+    while (!_tiles.empty() && _bytes + bytes > _maxBytes) {
+        _bytes -= _tiles.back().data.size() * sizeof(double);
+        _index.erase(_tiles.back().key);
+        _tiles.pop_back();
+    }
+
+    _tiles.push_front(Tile());
+    Tile &tile = _tiles.front();
+    tile.key = key;
+    tile.firstRow = firstRow;
+    tile.nRows = nRows;
+    tile.firstCol = firstCol;
+    tile.nCols = nCols;
+    tile.data.resize((size_t)nRows * nCols);
+
+    _source->getTile(table, firstRow, nRows, firstCol, nCols, &tile.data[0]);
+    _tileReads++;
+
+    _index[key] = _tiles.begin();
+    _bytes += bytes;
+
+    return _tiles.front();
+}
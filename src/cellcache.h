@@ -0,0 +1,60 @@
+/* cellcache.h
+ *
+ * Random access to single cells of a matrix, with an LRU cache of
+ * decoded tiles.
+ *
+ * A tile is the source's unit of random access (see getTileShape): one
+ * row for Cube and raw files, one chunk for OMX.  A batch lookup is
+ * sorted by tile first, so each tile it touches is read and decoded once,
+ * in whatever order the cells were asked for.
+ */
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "matrixio.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef CELLCACHE_H
+#define CELLCACHE_H
+
+#define  CELL_CACHE_BYTES  (64*1024*1024)
+
+class CellCache {
+public:
+    CellCache(MatrixSource *source, size_t maxBytes = CELL_CACHE_BYTES);
+
+    // Rows and columns are zone numbers from 1.  Cells outside the
+    // matrix come back as NaN.
+    double   getValue(int table, int row, int col);
+    void     getValues(int table, vector< pair<int,int> > &cells, double *values);
+
+    void     clear();
+    long long getTileReads();       // tiles read from the source so far
+
+private:
+    struct Tile {
+        long long key;
+        int      firstRow, nRows;
+        int      firstCol, nCols;
+        vector<double> data;
+    };
+
+    MatrixSource *_source;
+    size_t   _maxBytes;
+    size_t   _bytes;
+    long long _tileReads;
+
+    list<Tile> _tiles;              // most recently used first
+    map<long long, list<Tile>::iterator> _index;
+    map<int, pair<int,int> > _shape;   // tile rows, cols per table
+
+    pair<int,int> tileShape(int table);
+    long long tileKey(int table, int row, int col);
+    Tile&    fetch(int table, int row, int col);
+};
+
+#endif /* CELLCACHE_H */
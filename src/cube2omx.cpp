@@ -4,77 +4,592 @@
 #include <vector>
 #include <sstream>
 #include <string>
+#include <cstring>
+#include <cctype>
+#include <climits>
+#include <cstdint>
 
 #include <hdf5.h>
 #include <hdf5_hl.h>
 
+#ifdef _WIN32
 #include "tppmatrix.h"
+#endif
 #include "omxmatrix.h"
-
+#include "memmatrix.h"
+#include "densematrix.h"
+#include "zonesubset.h"
+#include "districts.h"
+#include "stats.h"
+#include "tablehash.h"
+#include "verify.h"
+#include "matrixdiff.h"
+#include "pipeline.h"
+#include "cellcache.h"
+#include "jobs.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+int convertFile(char *);
 int convertMat2h5(char *);
 int convertH5toMat(char *);
+int lookupValues(char *);
+int verifyFile(char *);
+int diffFile(char *);
 string get_new_extension(char *filename, const char *ext);
-
-int generateCubeOrder(map<int,string> &lookup, OMXMatrix* omx, int tables, const char* tnames[]);
-
-int copy_data(TPPMatrix*, OMXMatrix*, int, int, vector<string>&);
-int copy_data(OMXMatrix*, TPPMatrix*, int, int, map<int,string>&);
+string output_name(char *filename, const char *ext);
+bool isRowFormatName(string name);
+static bool hasExtension(string name, const char *ext);
+MatrixSink* createRowSink(string name, int tables, int zones, vector<string> &tableNames);
+SinkTap* addDenseExport(char *filename, string outName, int tables, int zones,
+                        vector<string> &tableNames, PipelineOptions &pipeline);
+void finishDenseExport(SinkTap *tap);
+int applyZoneSubset(MatrixSource* &matrix, int &rows, int &cols, ZoneSubset* &subset);
+void writeSubsetLookups(OMXMatrix *omx, ZoneSubset *subset);
+int planIncremental(char *filename, MatrixSource *matrix, string outName, int rows, int cols,
+                    vector<string> &names, vector<int> &order, TableHashes &hashes,
+                    vector<int> &written, vector<string> &removed,
+                    vector< pair<string,int> > &renumbered);
+int applyDistricts(MatrixSource* &matrix, vector<int> &order, vector<string> &names,
+                   int &rows, int &cols, vector<int> &districtNumbers);
+
+int generateCubeOrder(map<int,string> &lookup, OMXMatrix* omx, vector<string> &tnames);
 
 bool isOMX(char*);
+bool parseOption(int argc, char* argv[], int &i);
+void usage();
 
 hid_t _memspace = -1;
 hid_t _dataspace = -1;
 
+// Write native raw matrices instead of Cube .mat files (always on without the Cube DLL)
+#ifdef _WIN32
+bool _rawOutput = false;
+#else
+bool _rawOutput = true;
+#endif
+
+// Chunking and compression for OMX output
+OMXWriteOptions _omxOptions;
+
+// HDF5 caches for reading and writing OMX files
+OMXCacheOptions _cacheOptions;
+
+// Conversion pipeline stages and buffering
+PipelineOptions _pipeline;
+
+// Files converted at once, in worker processes
+int _jobs = 1;
+
+// Set in worker processes: where all output goes
+char* _logFile = NULL;
+
+// Keep Cube row indexes in .idx files next to the matrices
+bool _indexFiles = true;
+
+// Cells to look up instead of converting: "TABLE,ORIG,DEST" per line
+char* _lookupFile = NULL;
+
+// Output file for a single input; "-" streams raw rows to stdout
+char* _outFile = NULL;
+
+// Where a raw stream to stdout goes, once stdout itself is moved to stderr
+FILE* _streamOut = NULL;
+
+// Dense export: bytes per value (8 or 4) for .dmx output, and whether
+// -dense writes one alongside every conversion
+int _denseValueSize = 8;
+bool _denseExport = false;
+
+// Zones to convert (-zones, -origins, -dests); empty means all of them
+ZoneRanges _originZones;
+ZoneRanges _destZones;
+
+// Equivalency file for summing zones into districts (-districts)
+char* _equivFile = NULL;
+
+// Store summary statistics with every OMX table written
+bool _tableStats = true;
+
+// Rewrite only the tables of an existing OMX output whose contents changed
+bool _incremental = false;
+
+// Compare each input with its conversion instead of converting (-verify),
+// within an absolute and a relative tolerance
+bool _verify = false;
+double _verifyAtol = 0;
+double _verifyRtol = 0;
+
+// Base OMX file to compare each input with (-diff), the difference that
+// counts as large, and how many of the largest to list
+char* _diffBase = NULL;
+double _diffThreshold = 0;
+int _diffWorst = 10;
+
 int main(int argc, char* argv[])
 {
     // Get cmdline parameters
     // for each input .mat file
-    cout << "\nCube MAT/OMX Converter (built " << __DATE__ << " " << __TIME__ << ")\n";
     int errors = 0;
+    vector<char*> files;
+    vector<char*> options;     // passed on to worker processes
 
-    if (argc==1) {
-		cout << "\nUsage:  cube2omx.exe  [filename1] [filename2] ...\n";
-		cout << "        - Valid OMX files will be converted to Cube format\n";
-		cout << "        - Cube files will be converted to OMX\n";
-		cout << "        - Output files will have .omx or .mat extension\n\n";
-		exit(0);
+    for (int i=1; i<argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0') {    // "-" is stdin
+            files.push_back(argv[i]);
+            continue;
+        }
+
+        int first = i;
+        if (!parseOption(argc, argv, i)) {
+            fprintf(stderr, "\n** Unknown option %s\n", argv[i]);
+            exit(2);
+        }
+        if (strcmp(argv[first], "-j")!=0 && strcmp(argv[first], "-log")!=0) {
+            for (int k=first; k<=i; k++) options.push_back(argv[k]);
+        }
     }
 
-    for (int i=1; i<argc; i++) {
-        char *tpfilename = argv[i];
-        printf("\n\nConverting %s ",tpfilename);
+    if (_equivFile != NULL && !(_originZones.empty() && _destZones.empty())) {
+        fprintf(stderr, "\n** -districts can't be combined with -zones, -origins or -dests\n");
+        exit(2);
+    }
+
+    if (_outFile != NULL && files.size() > 1) {
+        fprintf(stderr, "\n** -out needs a single input file\n");
+        exit(2);
+    }
+
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+    // Streaming to stdout: keep the real stdout for the data, and send
+    // every message to stderr instead
+    if (_outFile != NULL && strcmp(_outFile, "-")==0) {
+        _streamOut = fdopen(dup(fileno(stdout)), "wb");
+        if (_streamOut == NULL) {
+            fprintf(stderr, "\n** Can't stream to stdout\n");
+            exit(2);
+        }
+#ifdef _WIN32
+        _setmode(_fileno(_streamOut), _O_BINARY);
+#endif
+        setvbuf(_streamOut, NULL, _IOFBF, 1024*1024);
+        fflush(stdout);
+        dup2(fileno(stderr), fileno(stdout));
+    }
+
+    // Worker process: everything goes to the log the parent will print
+    if (_logFile != NULL) {
+        freopen(_logFile, "w", stdout);
+        dup2(fileno(stdout), fileno(stderr));
+        setvbuf(stdout, NULL, _IONBF, 0);
+    } else {
+        cout << "\nCube MAT/OMX Converter (built " << __DATE__ << " " << __TIME__ << ")\n";
+    }
+
+    if (files.size()==0) {
+        usage();
+        exit(0);
+    }
+
+    if (_jobs > 1 && files.size() > 1) {
+        // Share the cores between workers unless told otherwise
+        char threads[16];
+        if (_omxOptions.threads == 0) {
+            _omxOptions.threads = max(1, ThreadPool::defaultThreads() / _jobs);
+            sprintf(threads, "%d", _omxOptions.threads);
+            options.push_back((char *) "-threads");
+            options.push_back(threads);
+        }
+        errors = runJobs(files, _jobs, argv[0], options, convertFile);
+
+    } else {
+        for (unsigned int i=0; i<files.size(); i++) {
+            errors += convertFile(files[i]);
+        }
+    }
+
+    int nfiles = files.size();
+    printf("\nDone; %d errors and %d of %d completed.\n",errors,nfiles-errors,nfiles);
+
+    // Scripts check -verify by its exit status
+    if (_verify && errors > 0) return 1;
+    return 0;
+}
+
+// Convert one file, in whichever direction it needs; returns the error count
+int convertFile(char *tpfilename) {
+        if (_lookupFile != NULL) return lookupValues(tpfilename);
+        if (_verify) return verifyFile(tpfilename);
+        if (_diffBase != NULL) return diffFile(tpfilename);
+
+        bool is_stdin = (strcmp(tpfilename, "-")==0);
+        printf("\n\nConverting %s ",is_stdin ? "stdin" : tpfilename);
+
+        if (is_stdin && _outFile == NULL) {
+            fprintf(stderr, "\n** Reading stdin needs -out FILE\n");
+            return 1;
+        }
 
 	// Make sure we can open it
 	ifstream file(tpfilename, ifstream::in);
-	if (!file) {
+	if (!is_stdin && !file) {
 		fprintf(stderr, "\n** Cannot find/open %s\n", tpfilename);
-		errors++;
-		continue;
+		return 1;
 	} else {
 		file.close();
 	}
 
         // Figure out which way we're converting:
-        bool is_omx = isOMX(tpfilename);
+        bool is_omx = !is_stdin && isOMX(tpfilename);
         int v;
 
-        if (is_omx) {
-            printf("to Cube: ");
+        // OMX to OMX only makes sense as an extract, e.g. with -zones
+        if (is_omx && !(_outFile && hasExtension(_outFile, ".omx"))) {
+            printf(_rawOutput ? "to raw: " : "to Cube: ");
             v = convertH5toMat(tpfilename);
         } else {
-            printf("to OMX: ");
+            if (_outFile == NULL || !isRowFormatName(_outFile)) printf("to OMX: ");
+            else printf(strcmp(_outFile, "-")==0 ? "to raw stream: " : "to Cube/raw: ");
             v = convertMat2h5(tpfilename);
         }
 
         if (v != 0) {
             printf("\n>> Failed to convert %s.",tpfilename);
-            errors += v;
         }
+
+        fflush(stdout);
+        return v;
+}
+
+
+void usage() {
+		cout << "\nUsage:  cube2omx.exe  [options] [filename1] [filename2] ...\n";
+		cout << "        - Valid OMX files will be converted to Cube format\n";
+		cout << "        - Cube files and raw matrix files will be converted to OMX\n";
+		cout << "        - Output files will have .omx or .mat extension\n";
+		cout << "        - A filename of - reads a raw matrix stream from stdin\n\n";
+		cout << "Options:\n";
+		cout << "   -raw             Convert OMX to raw matrix files (.raw) instead of Cube\n";
+		cout << "   -out FILE        Output file for a single input: .omx, .raw or .mat;\n";
+		cout << "                    - writes a raw matrix stream to stdout; .dmx a dense export\n";
+		cout << "   -dense T         Also write a dense, mmap-able .dmx file next to the\n";
+		cout << "                    output, with values of type T: float64 or float32\n";
+		cout << "   -chunk R,C       OMX chunk shape, rows x cols (default 1 row, all cols)\n";
+		cout << "   -chunk auto      Pick chunk shape from zone count and -access\n";
+		cout << "   -tile N          Square N x N chunks\n";
+		cout << "   -access row|tile Access pattern for -chunk auto (default row)\n";
+		cout << "   -deflate N       Deflate level 0-9 (default 7; 0 = no compression)\n";
+		cout << "   -nocompress      Same as -deflate 0\n";
+		cout << "   -shuffle         Add the byte-shuffle filter ahead of deflate\n";
+		cout << "   -type T          OMX value type: float64 (default), float32, int32,\n";
+		cout << "                    or scaled:S for int32 holding round(value * S)\n";
+		cout << "   -type NAME=T     Value type for table NAME only\n";
+		cout << "   -digits D        Lossy scale-offset filter keeping D decimal digits\n";
+		cout << "   -digits PAT=D    Scale-offset for tables matching PAT (* and ?);\n";
+		cout << "                    PAT=-1 leaves matching tables lossless\n";
+		cout << "   -sparse PAT      Store tables matching PAT (* and ?) sparse, as CSR;\n";
+		cout << "                    -sparse '*' for all tables\n";
+		cout << "   -threads N       Chunk compression threads (default: one per core;\n";
+		cout << "                    1 = compress inside the HDF5 filter pipeline)\n";
+		cout << "   -depth N         Row blocks in flight between pipeline stages (default 3)\n";
+		cout << "   -nopipeline      Run read, compress and write stages on one thread\n";
+		cout << "   -cache MB        Chunk cache per table (default: one chunk band,\n";
+		cout << "                    sharing 256 MB across tables)\n";
+		cout << "   -cacheslots N    Chunk cache hash slots (default: 100 per cached chunk)\n";
+		cout << "   -preempt W       Chunk cache preemption weight 0-1 (default 0.75)\n";
+		cout << "   -mdcache MB      Initial HDF5 metadata cache size\n";
+		cout << "   -sieve KB        HDF5 sieve buffer size\n";
+		cout << "   -zones LIST      Convert only these zones, e.g. 1-100,205 or @file\n";
+		cout << "   -origins LIST    Convert only these origins (rows)\n";
+		cout << "   -dests LIST      Convert only these destinations (columns); with\n";
+		cout << "                    -origins, a rectangular window for OMX output\n";
+		cout << "   -districts FILE  Sum zones into the districts listed in FILE\n";
+		cout << "                    (\"DISTRICT ZONES\" per line) and write the\n";
+		cout << "                    district-to-district matrix instead of the zone matrix\n";
+		cout << "   -nostats         Don't store summary statistics with OMX tables\n";
+		cout << "   -incremental     Update an existing OMX output, rewriting only the\n";
+		cout << "                    tables whose contents changed\n";
+		cout << "   -verify          Instead of converting, compare each input with the file\n";
+		cout << "                    a conversion would write, e.g. X.mat with X.omx\n";
+		cout << "   -atol X, -rtol X Tolerance for -verify: cells match within\n";
+		cout << "                    X + R * |value| (default 0: exact)\n";
+		cout << "   -diff BASE       Instead of converting, compare each OMX input with\n";
+		cout << "                    OMX file BASE, table by table; -out FILE.omx also\n";
+		cout << "                    writes the differences (input - BASE)\n";
+		cout << "   -threshold T     -diff counts differences larger than T (default 0)\n";
+		cout << "   -worst N         -diff lists the N largest differences (default 10)\n";
+		cout << "   -lookup FILE     Instead of converting, look up the cells listed in FILE\n";
+		cout << "                    (TABLE,ORIG,DEST per line) and write them to .lookup.csv\n";
+		cout << "   -noindex         Don't read or write .idx row index files for Cube input\n";
+		cout << "   -j N             Convert N files at once, in separate processes\n\n";
+}
+
+// Value following option argv[i]; advances i.
+char* optionValue(int argc, char* argv[], int &i) {
+    if (i+1 >= argc) {
+        fprintf(stderr, "\n** Option %s needs a value\n", argv[i]);
+        exit(2);
     }
+    return argv[++i];
+}
+
+// Parse a value type: float64, float32, int32 or scaled:S
+bool parseStorage(const char *value, OMXStorage &storage) {
+    if (strcmp(value, "float64")==0) storage.type = STORE_FLOAT64;
+    else if (strcmp(value, "float32")==0) storage.type = STORE_FLOAT32;
+    else if (strcmp(value, "int32")==0) storage.type = STORE_INT32;
+    else if (1 == sscanf(value, "scaled:%lf", &storage.scale) && storage.scale > 0) {
+        storage.type = STORE_SCALED;
+    } else {
+        return false;
+    }
+    return true;
+}
 
-    printf("\nDone; %d errors and %d of %d completed.\n",errors,argc-errors-1,argc-1);
+// Parse a size given in units of unit bytes, e.g. -cache 16 for 16 MB
+bool parseSize(const char *value, double unit, size_t &bytes) {
+    char *end;
+    double size = strtod(value, &end);
+    if (end == value || *end != '\0' || !(size >= 0) || size * unit > (double) SIZE_MAX / 2) {
+        return false;
+    }
+    bytes = (size_t)(size * unit);
+    return true;
 }
 
+// Parse the option at argv[i], consuming its value if it has one.
+// Returns false for unknown options.
+bool parseOption(int argc, char* argv[], int &i) {
+    char *opt = argv[i];
+
+    if (strcmp(opt, "-raw")==0) {
+        _rawOutput = true;
+
+    } else if (strcmp(opt, "-out")==0) {
+        _outFile = optionValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-zones")==0 || strcmp(opt, "-origins")==0 || strcmp(opt, "-dests")==0) {
+        char *value = optionValue(argc, argv, i);
+        ZoneRanges zones;
+        if (!ZoneSubset::parseZoneList(value, zones)) {
+            fprintf(stderr, "\n** Bad zone list %s; use e.g. 1-100,205 or @file\n", value);
+            exit(2);
+        }
+        if (strcmp(opt, "-dests")!=0) _originZones = zones;
+        if (strcmp(opt, "-origins")!=0) _destZones = zones;
+
+    } else if (strcmp(opt, "-nostats")==0) {
+        _tableStats = false;
+
+    } else if (strcmp(opt, "-incremental")==0) {
+        _incremental = true;
+
+    } else if (strcmp(opt, "-verify")==0) {
+        _verify = true;
+
+    } else if (strcmp(opt, "-diff")==0) {
+        _diffBase = optionValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-threshold")==0) {
+        char *value = optionValue(argc, argv, i), *end;
+        _diffThreshold = strtod(value, &end);
+        if (end == value || *end != '\0' || !(_diffThreshold >= 0)) {
+            fprintf(stderr, "\n** Bad threshold %s; use a number of at least 0\n", value);
+            exit(2);
+        }
+
+    } else if (strcmp(opt, "-worst")==0) {
+        char *value = optionValue(argc, argv, i), *end;
+        long worst = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || worst < 0 || worst > 100000) {
+            fprintf(stderr, "\n** Bad count %s for -worst; use 0-100000\n", value);
+            exit(2);
+        }
+        _diffWorst = (int) worst;
+
+    } else if (strcmp(opt, "-atol")==0 || strcmp(opt, "-rtol")==0) {
+        char *value = optionValue(argc, argv, i), *end;
+        double tol = strtod(value, &end);
+        if (end == value || *end != '\0' || !(tol >= 0)) {
+            fprintf(stderr, "\n** Bad tolerance %s for %s; use a number of at least 0\n", value, opt);
+            exit(2);
+        }
+        if (opt[1] == 'a') _verifyAtol = tol;
+        else _verifyRtol = tol;
+
+    } else if (strcmp(opt, "-districts")==0) {
+        _equivFile = optionValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-dense")==0) {
+        char *value = optionValue(argc, argv, i);
+        if (strcmp(value, "float64")==0) _denseValueSize = 8;
+        else if (strcmp(value, "float32")==0) _denseValueSize = 4;
+        else {
+            fprintf(stderr, "\n** Bad dense value type %s; use float64 or float32\n", value);
+            exit(2);
+        }
+        _denseExport = true;
+
+    } else if (strcmp(opt, "-chunk")==0) {
+        char *value = optionValue(argc, argv, i), extra;
+        if (strcmp(value, "auto")==0) {
+            _omxOptions.autoChunk = true;
+        } else if (2 == sscanf(value, "%d,%d%c", &_omxOptions.chunkRows, &_omxOptions.chunkCols, &extra) &&
+                   _omxOptions.chunkRows > 0 && _omxOptions.chunkCols >= 0) {
+            _omxOptions.autoChunk = false;
+        } else {
+            fprintf(stderr, "\n** Bad chunk shape %s; use rows,cols or auto\n", value);
+            exit(2);
+        }
+
+    } else if (strcmp(opt, "-tile")==0) {
+        char *value = optionValue(argc, argv, i), *end;
+        long size = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || size < 1 || size > INT_MAX) {
+            fprintf(stderr, "\n** Bad chunk shape %s; use a tile size of at least 1\n", value);
+            exit(2);
+        }
+        _omxOptions.autoChunk = false;
+        _omxOptions.chunkRows = _omxOptions.chunkCols = (int) size;
+
+    } else if (strcmp(opt, "-access")==0) {
+        char *value = optionValue(argc, argv, i);
+        if (strcmp(value, "row")==0) _omxOptions.access = ACCESS_ROW;
+        else if (strcmp(value, "tile")==0) _omxOptions.access = ACCESS_TILE;
+        else {
+            fprintf(stderr, "\n** Bad access pattern %s; use row or tile\n", value);
+            exit(2);
+        }
+
+    } else if (strcmp(opt, "-deflate")==0) {
+        char *value = optionValue(argc, argv, i), *end;
+        long level = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || level < 0 || level > 9) {
+            fprintf(stderr, "\n** Bad deflate level %s; use 0-9\n", value);
+            exit(2);
+        }
+        _omxOptions.deflate = (int) level;
+
+    } else if (strcmp(opt, "-nocompress")==0) {
+        _omxOptions.deflate = 0;
+
+    } else if (strcmp(opt, "-shuffle")==0) {
+        _omxOptions.shuffle = true;
+
+    } else if (strcmp(opt, "-type")==0) {
+        char *value = optionValue(argc, argv, i);
+        char *eq = strrchr(value, '=');
+        OMXStorage storage;
+
+        if (!parseStorage(eq ? eq+1 : value, storage)) {
+            fprintf(stderr, "\n** Bad value type %s; use float64, float32, int32 or scaled:S\n", value);
+            exit(2);
+        }
+        if (eq) _omxOptions.tableStorage[string(value, eq-value)] = storage;
+        else _omxOptions.storage = storage;
+
+    } else if (strcmp(opt, "-digits")==0) {
+        char *value = optionValue(argc, argv, i);
+        char *eq = strrchr(value, '=');
+        char *digitsText = eq ? eq+1 : value, *end;
+        long digits = strtol(digitsText, &end, 10);
+
+        // A typo must not quietly round the table to whole numbers
+        if (end == digitsText || *end != '\0' || digits < -1 || digits > 15 || eq == value) {
+            fprintf(stderr, "\n** Bad digits %s; use D or PAT=D, with D from 0 to 15 (-1 = lossless)\n", value);
+            exit(2);
+        }
+
+        if (eq) _omxOptions.digitPatterns.push_back(make_pair(string(value, eq-value), digits));
+        else _omxOptions.digits = digits;
+
+    } else if (strcmp(opt, "-sparse")==0) {
+        _omxOptions.sparsePatterns.push_back(optionValue(argc, argv, i));
+
+    } else if (strcmp(opt, "-threads")==0) {
+        char *value = optionValue(argc, argv, i), *end;
+        long threads = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || threads < 0 || threads > 1024) {
+            fprintf(stderr, "\n** Bad thread count %s; use 0-1024 (0 = one per core)\n", value);
+            exit(2);
+        }
+        _omxOptions.threads = (int) threads;
+
+    } else if (strcmp(opt, "-depth")==0) {
+        char *value = optionValue(argc, argv, i), *end;
+        long depth = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || depth < 1 || depth > INT_MAX) {
+            fprintf(stderr, "\n** Bad pipeline depth %s; use at least 1\n", value);
+            exit(2);
+        }
+        _pipeline.depth = (int) depth;
+
+    } else if (strcmp(opt, "-nopipeline")==0) {
+        _pipeline.threaded = false;
+
+    } else if (strcmp(opt, "-cache")==0 || strcmp(opt, "-mdcache")==0) {
+        char *value = optionValue(argc, argv, i);
+        size_t &bytes = opt[1] == 'c' ? _cacheOptions.chunkCacheBytes : _cacheOptions.metaCacheBytes;
+        if (!parseSize(value, 1024*1024, bytes)) {
+            fprintf(stderr, "\n** Bad size %s for %s; use MB, at least 0\n", value, opt);
+            exit(2);
+        }
+
+    } else if (strcmp(opt, "-cacheslots")==0) {
+        char *value = optionValue(argc, argv, i), *end;
+        long slots = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || slots < 0 || slots > INT_MAX) {
+            fprintf(stderr, "\n** Bad slot count %s for -cacheslots; use at least 0\n", value);
+            exit(2);
+        }
+        _cacheOptions.chunkCacheSlots = slots;
+
+    } else if (strcmp(opt, "-preempt")==0) {
+        char *value = optionValue(argc, argv, i), *end;
+        double weight = strtod(value, &end);
+        if (end == value || *end != '\0' || !(weight >= 0 && weight <= 1)) {
+            fprintf(stderr, "\n** Bad preemption weight %s; use 0-1\n", value);
+            exit(2);
+        }
+        _cacheOptions.preemption = weight;
+
+    } else if (strcmp(opt, "-sieve")==0) {
+        char *value = optionValue(argc, argv, i);
+        if (!parseSize(value, 1024, _cacheOptions.sieveBytes)) {
+            fprintf(stderr, "\n** Bad size %s for -sieve; use KB, at least 0\n", value);
+            exit(2);
+        }
+
+    } else if (strcmp(opt, "-j")==0) {
+        _jobs = atoi(optionValue(argc, argv, i));
+        if (_jobs < 1) {
+            fprintf(stderr, "\n** Job count must be at least 1\n");
+            exit(2);
+        }
+
+    } else if (strcmp(opt, "-noindex")==0) {
+        _indexFiles = false;
+
+    } else if (strcmp(opt, "-lookup")==0) {
+        _lookupFile = optionValue(argc, argv, i);
+
+    } else if (strcmp(opt, "-log")==0) {
+        _logFile = optionValue(argc, argv, i);
+
+    } else {
+        return false;
+    }
+
+    return true;
+}
 
 bool isOMX(char *filename) {
     htri_t answer = H5Fis_hdf5(filename);
@@ -98,63 +613,490 @@ bool isOMX(char *filename) {
 }
 
 
+// Open a Cube matrix, or a native raw matrix file, as a row source.
+// A lazy open indexes Cube rows only as far as they are read.
+// "-" is a raw matrix stream on stdin.
+MatrixSource* openCubeSource(char *filename, bool lazy) {
+    if (strcmp(filename, "-")==0) {
+        MemMatrix *raw = new MemMatrix();
+        setvbuf(stdin, NULL, _IOFBF, 1024*1024);
+        raw->openStream(stdin, "stdin");
+        return raw;
+    }
+    if (MemMatrix::isRawFile(filename)) {
+        MemMatrix *raw = new MemMatrix();
+        raw->openFile(filename);
+        return raw;
+    }
+#ifdef _WIN32
+    TPPMatrix *matrix = new TPPMatrix();
+    matrix->setIndexFile(_indexFiles);
+    matrix->openFile(filename, lazy);
+    return matrix;
+#else
+    fprintf(stderr, "\n** %s is not a raw matrix; Cube files need the Windows build.\n", filename);
+    return NULL;
+#endif
+}
+
 int convertMat2h5(char *filename) {
     int rows, cols, tables, rtn;
-    TPPMatrix *matrix;
+    MatrixSource *matrix;
     OMXMatrix *omx;
 
     vector<string> matNames;
+    vector<int> order;
 
     try {
-        // try to open file
-        matrix = new TPPMatrix();
-        matrix->openFile(filename);
+        // try to open file; with an origin subset, Cube rows are only
+        // indexed as far as the last origin needed
+        if (strcmp(filename, "-")!=0 && isOMX(filename)) {
+            OMXMatrix *in = new OMXMatrix();
+            in->setCacheOptions(_cacheOptions);
+            in->openFile(filename);
+            matrix = in;
+        } else {
+            matrix = openCubeSource(filename, !_originZones.empty());
+        }
+        if (matrix == NULL) return 1;
 
         // get tp+ parameters such as zones, tables, names.
-        rows = cols = matrix->getZones();
+        ZoneSubset *subset = NULL;
+        if (applyZoneSubset(matrix, rows, cols, subset) != 0) {
+            matrix->closeFile();
+            delete matrix;
+            return 1;
+        }
 
         tables = matrix->getTables();
         for (int t=1; t<=tables; t++) {
             string name(matrix->getTableName(t));
             matNames.push_back(name);
+            order.push_back(t);
+        }
+
+        vector<int> districts;
+        if (applyDistricts(matrix, order, matNames, rows, cols, districts) != 0) {
+            matrix->closeFile();
+            delete matrix;
+            return 1;
+        }
+
+        // Raw, Cube or dense output, e.g. from a stream: a straight row copy
+        string out_name = output_name(filename, ".omx");
+        if (rows != cols && (isRowFormatName(out_name) || _denseExport)) {
+            fprintf(stderr, "\n** An origin/destination window can only be written to OMX\n");
+            matrix->closeFile();
+            delete matrix;
+            return 1;
+        }
+
+        PipelineOptions pipeline = _pipeline;
+        SinkTap *dense = NULL;
+        try {
+            dense = addDenseExport(filename, out_name, tables, rows, matNames, pipeline);
+        } catch (DenseMatrix::FileOpenException&) {
+            matrix->closeFile();
+            delete matrix;
+            return 1;
+        }
+
+        if (isRowFormatName(out_name)) {
+            MatrixSink *sink = createRowSink(out_name, tables, rows, matNames);
+            if (sink == NULL) {
+                matrix->closeFile();
+                finishDenseExport(dense);
+                delete matrix;
+                return 1;
+            }
+
+            rtn = copy_data(matrix, sink, rows, tables, order, pipeline);
+
+            matrix->closeFile();
+            sink->closeFile();
+            finishDenseExport(dense);
+            delete matrix;
+            delete sink;
+            return rtn;
+        }
+
+        // Content hashes, for later -incremental runs.  An incremental
+        // run hashes first, then writes only the tables that changed.
+        TableHashes hashes(tables, rows, cols);
+        vector<int> written;
+        vector<string> removed;
+        vector< pair<string,int> > renumbered;
+        int update = 0;
+        if (_incremental) {
+            update = planIncremental(filename, matrix, out_name, rows, cols, matNames, order,
+                                     hashes, written, removed, renumbered);
+            if (update < 0) {
+                matrix->closeFile();
+                delete matrix;
+                return 1;
+            }
+        }
+        if (update == 0) {
+            written.clear();
+            for (int t=1; t<=tables; t++) written.push_back(t);
+        }
+
+        // Output tables being written, and their source tables
+        int nWritten = written.size();
+        vector<string> writeNames;
+        vector<int> writeOrder;
+        for (int i=0; i<nWritten; i++) {
+            writeNames.push_back(matNames[written[i]-1]);
+            writeOrder.push_back(order[written[i]-1]);
         }
 
-        // Create OMX file
-        string h5_name = get_new_extension(filename, ".omx");
+        // Create OMX file, or reopen it for the changed tables
         omx = new OMXMatrix();
-        omx->createFile(tables, rows, cols, matNames, h5_name);
+        omx->setWriteOptions(_omxOptions);
+        omx->setCacheOptions(_cacheOptions);
+        if (update) {
+            omx->updateFile(matNames, writeNames, written, removed, out_name);
+            for (unsigned int i=0; i<renumbered.size(); i++) {
+                omx->setCubeNumber(renumbered[i].first, renumbered[i].second);
+            }
+        } else {
+            omx->createFile(tables, rows, cols, matNames, out_name);
+        }
+        writeSubsetLookups(omx, subset);
+        if (!districts.empty()) omx->writeLookup("district", districts, NULL);
+
+        // Summary statistics and hashes, gathered as the rows go by
+        StatsCollector *stats = NULL;
+        if (_tableStats) {
+            stats = new StatsCollector(nWritten, rows, cols);
+            pipeline.transforms.push_back(stats);
+        }
+        SinkTap hashTap(&hashes, tables);
+        if (!update) pipeline.transforms.push_back(&hashTap);
 
         // Copy data
-        rtn = copy_data(matrix, omx, rows, tables, matNames);
+        rtn = 0;
+        if (nWritten > 0) rtn = copy_data(matrix, omx, rows, nWritten, writeOrder, pipeline);
+        finishDenseExport(dense);
+
+        if (omx->getZeroChunks() > 0) {
+            printf("Skipped %lld all-zero chunks\n", omx->getZeroChunks());
+        }
+
+        if (stats != NULL) {
+            for (int t=1; t<=nWritten; t++) omx->writeStats(t, stats->getStats(t));
+            delete stats;
+        }
+
+        for (int t=1; t<=nWritten; t++) {
+            omx->writeContentHash(t, hashes.getHash(written[t-1]));
+
+            int digits = omx->getScaleOffsetDigits(t);
+            if (digits >= 0) {
+                printf("Scale-offset %d digits: %s max abs error %g\n", digits,
+                       writeNames[t-1].c_str(), omx->getScaleOffsetError(t));
+            }
+        }
 
         // All done
         matrix->closeFile();
         omx->closeFile();
 
+        delete matrix;
+        delete omx;
+
+#ifdef _WIN32
     } catch (TPPMatrix::FileOpenException&) {
         printf("Can't open %s.",filename);
         return 1;
+#endif
+    } catch (MemMatrix::FileOpenException&) {
+        printf("Can't open %s.",filename);
+        return 1;
     }
 
-    return 0;
+    return rtn;
 }
 
-int generateCubeOrder(map<int,string> &lookup, OMXMatrix* omx, int tables, const char* tnames[]) {
+/*
+ * Compare filename with the file its conversion would write: a Cube or
+ * raw matrix with its OMX, or the other way round.  OMX tables are taken
+ * in CUBE_MAT_NUMBER order.  The matrix is read in the pipeline's read
+ * stage, and the OMX file in the VerifySink, which compares on -threads
+ * threads.  Returns 1 if any cell is out of tolerance.
+ */
+int verifyFile(char *filename) {
+    bool is_stdin = (strcmp(filename, "-")==0);
+    printf("\n\nVerifying %s against ", is_stdin ? "stdin" : filename);
+
+    if (!_originZones.empty() || !_destZones.empty() || _equivFile != NULL) {
+        fprintf(stderr, "\n** -verify compares whole matrices; drop -zones, -origins, -dests and -districts\n");
+        return 1;
+    }
+    if (is_stdin && _outFile == NULL) {
+        fprintf(stderr, "\n** Verifying stdin needs -out FILE\n");
+        return 1;
+    }
+
+    string matName, omxName;
+    if (!is_stdin && isOMX(filename)) {
+        omxName = filename;
+        matName = output_name(filename, _rawOutput ? ".raw" : ".mat");
+    } else {
+        matName = filename;
+        omxName = output_name(filename, ".omx");
+    }
+
+    MatrixSource *matrix;
+    try {
+        matrix = openCubeSource((char *) matName.c_str(), false);
+#ifdef _WIN32
+    } catch (TPPMatrix::FileOpenException&) {
+        printf("Can't open %s.", matName.c_str());
+        return 1;
+#endif
+    } catch (MemMatrix::FileOpenException&) {
+        printf("Can't open %s.", matName.c_str());
+        return 1;
+    }
+    if (matrix == NULL) return 1;
+
+    if (H5Fis_hdf5(omxName.c_str()) <= 0) {
+        fprintf(stderr, "\n** Cannot open %s as OMX\n", omxName.c_str());
+        matrix->closeFile();
+        delete matrix;
+        return 1;
+    }
+    OMXMatrix *omx = new OMXMatrix();
+    omx->setCacheOptions(_cacheOptions);
+    omx->openFile(omxName);
+
+    int zones = matrix->getZones();
+    int tables = matrix->getTables();
+    vector<string> omxNames;
+    for (int t=1; t<=omx->getTables(); t++) omxNames.push_back(omx->getTableName(t));
+
+    map<int,string> cubeOrder;
+    bool ok = true;
+    if (omx->getRows() != zones || omx->getCols() != zones) {
+        fprintf(stderr, "\n** %s has %d zones, but %s is %d x %d\n", matName.c_str(), zones,
+                omxName.c_str(), omx->getRows(), omx->getCols());
+        ok = false;
+    } else if (omx->getTables() != tables) {
+        fprintf(stderr, "\n** %s has %d tables, but %s has %d\n", matName.c_str(), tables,
+                omxName.c_str(), omx->getTables());
+        ok = false;
+    } else if (generateCubeOrder(cubeOrder, omx, omxNames) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        matrix->closeFile();
+        omx->closeFile();
+        delete matrix;
+        delete omx;
+        return 1;
+    }
+
+    // Matrix table t against the OMX table with CUBE_MAT_NUMBER t
+    vector<int> order, omxOrder;
+    for (int t=1; t<=tables; t++) {
+        order.push_back(t);
+        omxOrder.push_back(omx->getTableNumber(cubeOrder[t]));
+        if (cubeOrder[t] != matrix->getTableName(t)) {
+            printf("Note: table %d is %s in %s but %s in %s\n", t, matrix->getTableName(t).c_str(),
+                   matName.c_str(), cubeOrder[t].c_str(), omxName.c_str());
+        }
+    }
+
+    VerifySink verify(omx, omxOrder, _verifyAtol, _verifyRtol, _omxOptions.threads);
+    int rtn = copy_data(matrix, &verify, zones, tables, order, _pipeline);
+
+    printf("\nTolerance %g + %g * |value|\n", _verifyAtol, _verifyRtol);
+    int failed = 0;
+    for (int t=1; t<=tables; t++) {
+        TableCompare &c = verify.getResult(t);
+        printf("  %-20s max diff %-12g", cubeOrder[t].c_str(), c.maxDiff);
+        if (c.maxRow > 0) printf(" at %d,%d", c.maxRow, c.maxCol);
+
+        if (c.mismatches == 0) {
+            printf("  OK\n");
+            continue;
+        }
+        failed++;
+        printf("  %lld cells differ\n", c.mismatches);
+        for (unsigned int i=0; i<c.first.size(); i++) {
+            printf("    %d,%d: %.17g vs %.17g\n", c.first[i].row, c.first[i].col,
+                   c.first[i].expected, c.first[i].actual);
+        }
+    }
+    if (failed > 0) printf(">> %d of %d tables differ\n", failed, tables);
+    else printf("All %d tables match\n", tables);
+
+    matrix->closeFile();
+    omx->closeFile();
+    delete matrix;
+    delete omx;
+
+    return (rtn != 0 || failed > 0) ? 1 : 0;
+}
+
+static long long lcm(long long a, long long b) {
+    long long x = a, y = b;
+    while (y != 0) {
+        long long r = x % y;
+        x = y;
+        y = r;
+    }
+    return a / x * b;
+}
+
+/*
+ * Difference statistics of every table filename shares with _diffBase, in
+ * filename's table order: the base is read by copy_data() and filename by
+ * a DiffSink, in blocks of whole chunk bands of both (and of the delta
+ * file, with -out) where those fit the block budget.  Tables in only one
+ * of the files are listed.
+ */
+int diffFile(char *filename) {
+    printf("\n\nComparing %s with %s: ", filename, _diffBase);
+
+    if (!_originZones.empty() || !_destZones.empty() || _equivFile != NULL) {
+        fprintf(stderr, "\n** -diff compares whole matrices; drop -zones, -origins, -dests and -districts\n");
+        return 1;
+    }
+    if (strcmp(filename, "-")==0 || !isOMX(filename) || !isOMX(_diffBase)) {
+        fprintf(stderr, "\n** -diff compares OMX files\n");
+        return 1;
+    }
+
+    OMXMatrix *base = new OMXMatrix();
+    OMXMatrix *other = new OMXMatrix();
+    base->setCacheOptions(_cacheOptions);
+    other->setCacheOptions(_cacheOptions);
+    base->openFile(_diffBase);
+    other->openFile(filename);
+
+    int zones = base->getZones();
+    if (other->getRows() != base->getRows() || other->getCols() != base->getCols()) {
+        fprintf(stderr, "\n** %s is %d x %d, but %s is %d x %d\n", filename, other->getRows(),
+                other->getCols(), _diffBase, base->getRows(), base->getCols());
+        base->closeFile();
+        other->closeFile();
+        delete base;
+        delete other;
+        return 1;
+    }
+    if (base->getRows() != base->getCols()) {
+        fprintf(stderr, "\n** %s is a %d x %d origin/destination window; -diff compares square matrices\n",
+                filename, other->getRows(), other->getCols());
+        base->closeFile();
+        other->closeFile();
+        delete base;
+        delete other;
+        return 1;
+    }
+
+    // Shared tables: base table order[t-1] against other table otherOrder[t-1]
+    vector<string> names, onlyOther, onlyBase;
+    vector<int> order, otherOrder;
+    for (int t=1; t<=other->getTables(); t++) {
+        string name = other->getTableName(t);
+        int b = base->getTableNumber(name);
+        if (b < 0) {
+            onlyOther.push_back(name);
+            continue;
+        }
+        names.push_back(name);
+        order.push_back(b);
+        otherOrder.push_back(t);
+    }
+    for (int t=1; t<=base->getTables(); t++) {
+        if (other->getTableNumber(base->getTableName(t)) < 0) onlyBase.push_back(base->getTableName(t));
+    }
+    for (unsigned int i=0; i<onlyOther.size(); i++) printf("\n  only in %s: %s", filename, onlyOther[i].c_str());
+    for (unsigned int i=0; i<onlyBase.size(); i++) printf("\n  only in %s: %s", _diffBase, onlyBase[i].c_str());
+
+    int tables = names.size();
+    int rtn = 0;
+    if (tables > 0) {
+        OMXMatrix *delta = NULL;
+        if (_outFile != NULL) {
+            printf("\n  differences to %s", _outFile);
+            delta = new OMXMatrix();
+            delta->setWriteOptions(_omxOptions);
+            delta->setCacheOptions(_cacheOptions);
+            delta->createFile(tables, zones, zones, names, _outFile);
+        }
+
+        // Rows that are whole chunk bands of every table involved, in any
+        // file; past the zone count there is no such block
+        long long band = 1;
+        int rows, cols;
+        for (int t=1; t<=tables && band <= zones; t++) {
+            base->getTileShape(order[t-1], rows, cols);
+            band = lcm(band, rows);
+            other->getTileShape(otherOrder[t-1], rows, cols);
+            band = lcm(band, rows);
+            if (delta != NULL) {
+                delta->getTileShape(t, rows, cols);
+                band = lcm(band, rows);
+            }
+        }
+        if (band > zones) band = 0;
+
+        DiffSink diff(other, otherOrder, band, _diffThreshold, _diffWorst, delta);
+        rtn = copy_data(base, &diff, zones, tables, order, _pipeline);
+
+        printf("\n%s - %s:\n", filename, _diffBase);
+        for (int t=1; t<=tables; t++) {
+            TableDiff &d = diff.getResult(t);
+            long long n = d.cells - d.stats.nans;
+            double rms = n > 0 ? sqrt(d.stats.sumSquares / n) : 0;
+            double mean = n > 0 ? d.stats.sum / n : 0;
+
+            printf("  %-20s max |diff| %-12g RMS %-12g mean %-12g %lld over %g",
+                   names[t-1].c_str(), d.stats.maxAbs, rms, mean, d.stats.over, _diffThreshold);
+            if (d.stats.nans > 0) printf(", %lld NaN", d.stats.nans);
+            printf("\n");
+
+            for (unsigned int i=0; i<d.worst.size(); i++) {
+                ODPair &p = d.worst[i];
+                printf("    %d,%d: %.10g -> %.10g (%+.10g)\n", p.orig, p.dest, p.base, p.other, p.diff);
+            }
+        }
+
+        if (delta != NULL) {
+            delta->closeFile();
+            delete delta;
+        }
+    }
+
+    base->closeFile();
+    other->closeFile();
+    delete base;
+    delete other;
+    return rtn;
+}
+
+int generateCubeOrder(map<int,string> &lookup, OMXMatrix* omx, vector<string> &tnames) {
+    int tables = tnames.size();
+
     // Make sure there is EXACTLY one table for each CUBE_MAT_NUMBER in the
     // table range. Fail if there are dupes or missing numbers.
-    boolean quit = false;
+    bool quit = false;
 
     for (int i=0; i<tables;i++) {
         string tablename(tnames[i]);
+        const char *tname = tablename.c_str();
         int cubenum = omx->getCubeNumber(tablename);
 
         if (cubenum<1) {
-            fprintf(stderr, "\n** Table %s does not have required CUBE_MAT_NUMBER attribute",tnames[i]);
+            fprintf(stderr, "\n** Table %s does not have required CUBE_MAT_NUMBER attribute",tname);
             quit = true;
             continue;
         }
         if (lookup.count(cubenum)>0) {
-            fprintf(stderr, "\n** Table %s has duplicate CUBE_MAT_NUMBER attribute: %s (%d)",tnames[i],lookup[cubenum].c_str(), cubenum);
+            fprintf(stderr, "\n** Table %s has duplicate CUBE_MAT_NUMBER attribute: %s (%d)",tname,lookup[cubenum].c_str(), cubenum);
             quit = true;
             continue;
         }
@@ -177,114 +1119,489 @@ int generateCubeOrder(map<int,string> &lookup, OMXMatrix* omx, int tables, const
 }
 
 int convertH5toMat(char *filename) {
-    int zones, tables, rtn;
-    TPPMatrix *tpp;
+    int zones, cols, tables, rtn;
+    MatrixSink *sink = NULL;
+    MatrixSource *source;
     OMXMatrix *omx;
-    const char* tnames_native[MAX_TABLES];     // OMX doesn't have any idea about matrix 'order'
+    ZoneSubset *subset = NULL;
     map<int,string> tnames_cube_lookup; // Cube needs things in a specific order.
-    const char* tnames_cube_order[MAX_TABLES];
+    vector<string> names_native;        // OMX doesn't have any idea about matrix 'order'
+    vector<string> names_cube_order;
+    vector<int> order;
 
     // Open h5 file and get dimensions, table names
     omx = new OMXMatrix();
+    omx->setCacheOptions(_cacheOptions);
     omx->openFile(filename);
 
     tables = omx->getTables();
-    zones  = omx->getRows();
+
+    source = omx;
+    if (applyZoneSubset(source, zones, cols, subset) != 0) {
+        source->closeFile();
+        delete source;
+        return 1;
+    }
+    if (zones != cols) {
+        fprintf(stderr, "\n** An origin/destination window can only be written to OMX\n");
+        source->closeFile();
+        delete source;
+        return 1;
+    }
 
     for (int t=1; t<=tables; t++) {
-        tnames_native[t-1]=omx->getTableName(t).c_str();
+        names_native.push_back(omx->getTableName(t));
     }
 
     // Verify and set up Cube matrix order from CUBE_MAT_NUMBER attributes
-    int status = generateCubeOrder(tnames_cube_lookup, omx, tables, tnames_native);
-    if (status<0) return 1;
+    int status = generateCubeOrder(tnames_cube_lookup, omx, names_native);
+    if (status<0) {
+        source->closeFile();
+        delete source;
+        return 1;
+    }
 
     for (int i=0; i<tables;i++) {
-        tnames_cube_order[i] = tnames_cube_lookup[i+1].c_str();
+        names_cube_order.push_back(tnames_cube_lookup[i+1]);
+        order.push_back(omx->getTableNumber(tnames_cube_lookup[i+1]));
+    }
+
+    vector<int> districts;
+    if (applyDistricts(source, order, names_cube_order, zones, cols, districts) != 0) {
+        source->closeFile();
+        delete source;
+        return 1;
     }
 
     // create TPP file
+    PipelineOptions pipeline = _pipeline;
+    SinkTap *dense = NULL;
+    string out_name = output_name(filename, _rawOutput ? ".raw" : ".mat");
     try {
-        string tppname = get_new_extension(filename, ".mat");
-        tpp = new TPPMatrix();
-        tpp->createFile(tables, zones, tnames_cube_order, tppname.c_str());
+        sink = createRowSink(out_name, tables, zones, names_cube_order);
+        if (sink != NULL) dense = addDenseExport(filename, out_name, tables, zones, names_cube_order, pipeline);
 
+#ifdef _WIN32
     } catch (TPPMatrix::FileOpenException&) {
         printf("Can't open %s.",filename);
+#endif
+    } catch (MemMatrix::FileOpenException&) {
+        printf("Can't open %s.",filename);
+    } catch (DenseMatrix::FileOpenException&) {
+        // Don't leave the output half written
+        sink->closeFile();
+        delete sink;
+        sink = NULL;
+        if (out_name != "-") remove(out_name.c_str());
+    }
+    if (sink == NULL) {
+        source->closeFile();
+        delete source;
         return 1;
     }
 
     // Copy data
-    rtn = copy_data(omx, tpp, zones, tables, tnames_cube_lookup);
+    rtn = copy_data(source, sink, zones, tables, order, pipeline);
 
     /* Close the files. */
-    tpp->closeFile();
-    omx->closeFile();
+    sink->closeFile();
+    source->closeFile();
+    finishDenseExport(dense);
 
-    return 0;
+    delete sink;
+    delete source;
+
+    return rtn;
 }
 
-// Copy from HDF5 to TPP:
-int copy_data(OMXMatrix *omx, TPPMatrix *matrix, int zones, int tables, map<int,string> &order) {
+/*
+ * Look up the cells listed in _lookupFile and write them, in the same
+ * order, to filename.lookup.csv.  Tables are given by name, or by Cube
+ * table number: CUBE_MAT_NUMBER in OMX files.
+ * Works on any input; cells are read through a CellCache, so each row or
+ * chunk is decoded once however the cells are ordered.
+ */
+int lookupValues(char *filename) {
+    vector<string> tableNames;
+    vector< pair<int,int> > cells;
+    char line[1024], name[512];
+    int orig, dest;
+
+    printf("\n\nLooking up %s in %s: ", _lookupFile, filename);
+
+    FILE *in = fopen(_lookupFile, "r");
+    if (in == NULL) {
+        fprintf(stderr, "\n** Cannot open lookup file %s\n", _lookupFile);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        for (char *c = line; *c; c++) if (*c == ',') *c = ' ';
+        if (3 != sscanf(line, "%511s %d %d", name, &orig, &dest)) continue;  // header, blanks
+        tableNames.push_back(name);
+        cells.push_back(make_pair(orig, dest));
+    }
+    fclose(in);
 
-    // Set up some scratch space for reading row data
-    double *rowdata = matrix->allocateRowBuffer();
+    MatrixSource *matrix;
+    OMXMatrix *omx = NULL;
+    if (isOMX(filename)) {
+        omx = new OMXMatrix();
+        omx->setCacheOptions(_cacheOptions);
+        omx->openFile(filename);
+        matrix = omx;
+    } else {
+        try {
+            matrix = openCubeSource(filename, true);
+#ifdef _WIN32
+        } catch (TPPMatrix::FileOpenException&) {
+            printf("Can't open %s.",filename);
+            return 1;
+#endif
+        } catch (MemMatrix::FileOpenException&) {
+            printf("Can't open %s.",filename);
+            return 1;
+        }
+        if (matrix == NULL) return 1;
+    }
 
-    int row;
-    printf("\n");
+    map<string,int> tableNumber;
+    vector<string> names;
+    for (int t=1; t<=matrix->getTables(); t++) {
+        tableNumber[matrix->getTableName(t)] = t;
+        names.push_back(matrix->getTableName(t));
+    }
+
+    // OMX tables needn't be stored in Cube order: numbers go by CUBE_MAT_NUMBER
+    map<int,string> cubeOrder;
+    bool numbered = false;
+
+    // One batch per table
+    map<int, vector<int> > byTable;
+    for (unsigned int i=0; i<cells.size(); i++) {
+        int t = -1;
+        if (tableNumber.count(tableNames[i])) t = tableNumber[tableNames[i]];
+        else if (strspn(tableNames[i].c_str(), "0123456789") == tableNames[i].size()) {
+            t = atoi(tableNames[i].c_str());
+            if (omx != NULL) {
+                if (!numbered && generateCubeOrder(cubeOrder, omx, names) != 0) {
+                    fprintf(stderr, "\n** Can't look up tables of %s by number\n", filename);
+                    matrix->closeFile();
+                    delete matrix;
+                    return 1;
+                }
+                numbered = true;
+                t = cubeOrder.count(t) ? tableNumber[cubeOrder[t]] : -1;
+            }
+        }
+        if (t < 1 || t > matrix->getTables()) {
+            fprintf(stderr, "\n** No table %s in %s\n", tableNames[i].c_str(), filename);
+            matrix->closeFile();
+            delete matrix;
+            return 1;
+        }
+        byTable[t].push_back(i);
+    }
 
-    // Loop on all rows
-    for (row=1;row<=zones;row++) {
-        if (row % 127 ==0) printf("Zone: %d\r",row);
+    CellCache cache(matrix);
+    vector<double> values(cells.size());
 
-        // Loop for each table
-        for (int t=1;t<=tables;t++) {
-            // Grab a row of data
-            omx->getRow(order[t], row, rowdata);
+    for (map<int, vector<int> >::iterator it = byTable.begin(); it != byTable.end(); it++) {
+        vector< pair<int,int> > batch;
+        vector<double> found(it->second.size());
+        for (unsigned int k=0; k<it->second.size(); k++) batch.push_back(cells[it->second[k]]);
 
-            // And write it to h5
-            matrix->writeRow(t, row, rowdata);
-        }
+        cache.getValues(it->first, batch, &found[0]);
+        for (unsigned int k=0; k<it->second.size(); k++) values[it->second[k]] = found[k];
+    }
+
+    string outName = get_new_extension(filename, ".lookup.csv");
+    FILE *out = fopen(outName.c_str(), "w");
+    if (out == NULL) {
+        fprintf(stderr, "\n** Could not create %s\n", outName.c_str());
+        matrix->closeFile();
+        delete matrix;
+        return 1;
+    }
+    fprintf(out, "TABLE,ORIG,DEST,VALUE\n");
+    for (unsigned int i=0; i<cells.size(); i++) {
+        fprintf(out, "%s,%d,%d,%.17g\n", tableNames[i].c_str(), cells[i].first, cells[i].second, values[i]);
     }
+    fclose(out);
 
-    printf("Zone: %d\n",row-1);
-    free(rowdata);
+    printf("%d cells from %d tables; %lld rows/chunks read\n",
+           (int)cells.size(), (int)byTable.size(), cache.getTileReads());
 
+    matrix->closeFile();
+    delete matrix;
     return 0;
 }
 
-// Copy from TPP to HDF5:
-int copy_data(TPPMatrix *matrix, OMXMatrix *omx, int zones, int tables, vector<string> &matNames) {
-    double*     rowdata;
+/*
+ * With -zones, -origins or -dests, replace matrix with a ZoneSubset of it.
+ * rows and cols are set to the size of what will be converted.  Returns
+ * nonzero if a zone is out of range, or if matrix is not square: an OMX
+ * window can't be converted again.
+ */
+int applyZoneSubset(MatrixSource* &matrix, int &rows, int &cols, ZoneSubset* &subset) {
+    int zones = matrix->getZones();
+    rows = zones;
+    cols = matrix->getCols();
+    subset = NULL;
+    if (rows != cols) {
+        fprintf(stderr, "\n** The input is a %d x %d origin/destination window; only square matrices can be converted\n",
+                rows, cols);
+        return 1;
+    }
+    if (_originZones.empty() && _destZones.empty()) return 0;
+
+    ZoneRanges all(1, make_pair(1, zones));
+    vector<int> origins, dests;
+    int bad;
+    if (!ZoneSubset::expandZoneList(_originZones.empty() ? all : _originZones, zones, origins, bad) ||
+        !ZoneSubset::expandZoneList(_destZones.empty() ? all : _destZones, zones, dests, bad)) {
+        fprintf(stderr, "\n** Zone %d is out of range; the matrix has %d zones\n", bad, zones);
+        return 1;
+    }
 
-    // Set up some scratch space for reading row data
-    rowdata = matrix->allocateRowBuffer();
+    rows = origins.size();
+    cols = dests.size();
+    printf("%d origins x %d destinations of %d zones: ", rows, cols, zones);
 
-    // Loop for each row
-    int col;
-    for (col=1;col<=zones;col++) {
-        if (col %47 == 1) printf("\r%d tables:  zone %d     ",tables, col);
-        for (int t=1; t<=tables; t++) {
-            // Grab a row of data
-            try {
-                matrix->getRow(t, col, rowdata);
-            } catch (TPPMatrix::MatrixReadException&) {
-                    fprintf(stderr, "ERROR: Can't read table row %d in table %d!\n", col, t);
-                    exit(2);
-            }
+    subset = new ZoneSubset(matrix, origins, dests);
+    matrix = subset;
+    return 0;
+}
 
-            // And write it to h5
-            omx->writeRow(matNames[t-1], col, rowdata);
-        }
+/*
+ * With -districts, sum the source into districts in a first pass over its
+ * rows, and convert the district totals instead.  matrix becomes an
+ * in-memory matrix with its tables already in sink order, so order is
+ * reset to 1..tables.  districtNumbers gets each output district's number.
+ */
+int applyDistricts(MatrixSource* &matrix, vector<int> &order, vector<string> &names,
+                   int &rows, int &cols, vector<int> &districtNumbers) {
+    if (_equivFile == NULL) return 0;
+
+    int zones = matrix->getZones();
+    int tables = order.size();
+
+    vector<int> zoneDistrict;
+    if (!DistrictSums::readEquivalency(_equivFile, zones, zoneDistrict)) return 1;
+
+    DistrictSums sums(zoneDistrict, tables);
+    if (sums.getDistricts() == 0) {
+        fprintf(stderr, "\n** No districts in %s\n", _equivFile);
+        return 1;
     }
+    printf("%d zones into %d districts: ", zones, sums.getDistricts());
+
+    int rtn = copy_data(matrix, &sums, zones, tables, order, _pipeline);
+    if (rtn != 0) return rtn;
 
-    // Clean up
-    printf("\r%d tables:  zone %d     \n",tables, col-1);
+    MemMatrix *totals = new MemMatrix();
+    sums.getMatrix(*totals, names);
 
-    free(rowdata);
+    matrix->closeFile();
+    delete matrix;
+    matrix = totals;
+
+    for (int t=1; t<=tables; t++) order[t-1] = t;
+    rows = cols = sums.getDistricts();
+    districtNumbers = sums.getDistrictNumbers();
     return 0;
 }
 
+/*
+ * With -incremental, hash every table in a pass of its own and compare the
+ * hashes with the CONTENT_HASH of the tables already in outName, and the
+ * current write options with their WRITE_SETTINGS.  Returns 1 if the file
+ * can be updated in place: written gets the output tables (from 1) that
+ * changed, are new or would now be stored differently, removed the file's
+ * tables that are no longer in the source, and renumbered the unchanged
+ * tables that moved.  Returns 0 if the file must be written in full, and
+ * -1 on errors.
+ */
+int planIncremental(char *filename, MatrixSource *matrix, string outName, int rows, int cols,
+                    vector<string> &names, vector<int> &order, TableHashes &hashes,
+                    vector<int> &written, vector<string> &removed,
+                    vector< pair<string,int> > &renumbered) {
+    const char *full = NULL;
+    FILE *f = fopen(outName.c_str(), "rb");
+
+    if (strcmp(filename, "-")==0) {
+        full = "a stream can't be read twice";
+    } else if (_denseExport) {
+        full = "-dense exports every table";
+    } else if (f == NULL) {
+        full = "no existing output";
+    } else if (H5Fis_hdf5(outName.c_str()) <= 0) {
+        full = "existing output is not OMX";
+    } else {
+        hid_t h5 = H5Fopen(outName.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (H5LTfind_attribute(h5, "OMX_VERSION") <= 0) full = "existing output is not OMX";
+        H5Fclose(h5);
+    }
+    if (f != NULL) fclose(f);
+
+    // What the file holds now: table -> hash, CUBE_MAT_NUMBER, and whether
+    // it was stored the way the current options would store it
+    map<string,string> oldHash;
+    map<string,int> oldNumber;
+    map<string,bool> oldSettings;
+    if (full == NULL) {
+        OMXMatrix old;
+        old.setWriteOptions(_omxOptions);
+        old.openFile(outName);
+        if (old.getRows() != rows || old.getCols() != cols) {
+            full = "existing output has a different shape";
+        }
+        for (int t=1; t<=old.getTables(); t++) {
+            string name = old.getTableName(t);
+            oldHash[name] = old.getContentHash(name);
+            oldNumber[name] = old.getCubeNumber(name);
+            oldSettings[name] = (old.getWriteSettings(name) == old.describeWriteOptions(name));
+        }
+        old.closeFile();
+    }
+
+    if (full != NULL) {
+        printf("  converting in full: %s\n", full);
+        return 0;
+    }
+
+    printf("  hashing: ");
+    int tables = names.size();
+    int rtn = copy_data(matrix, &hashes, rows, tables, order, _pipeline);
+    if (rtn != 0) return -1;
+
+    for (int t=1; t<=tables; t++) {
+        string &name = names[t-1];
+        if (oldHash.count(name)==0 || oldHash[name] != hashes.getHash(t) || !oldSettings[name]) {
+            written.push_back(t);
+        } else if (oldNumber[name] != t) {
+            renumbered.push_back(make_pair(name, t));
+        }
+        oldHash.erase(name);
+    }
+    for (map<string,string>::iterator it = oldHash.begin(); it != oldHash.end(); it++) {
+        removed.push_back(it->first);
+    }
+
+    printf("\n  %d of %d tables changed", (int)written.size(), tables);
+    for (unsigned int i=0; i<written.size(); i++) {
+        printf("%s%s", i==0 ? ": " : ", ", names[written[i]-1].c_str());
+    }
+    if (!removed.empty()) printf("; %d removed", (int)removed.size());
+    if (!renumbered.empty()) printf("; %d renumbered", (int)renumbered.size());
+    printf("\n");
+    return 1;
+}
+
+// Zone numbers of a subset, as OMX lookups: one for both sides if they match
+void writeSubsetLookups(OMXMatrix *omx, ZoneSubset *subset) {
+    if (subset == NULL) return;
+
+    if (subset->getOriginZones() == subset->getDestZones()) {
+        omx->writeLookup("zone_number", subset->getOriginZones(), NULL);
+    } else {
+        omx->writeLookup("origin_zone", subset->getOriginZones(), "row");
+        omx->writeLookup("destination_zone", subset->getDestZones(), "col");
+    }
+}
+
+// Output name for filename: -out if given, else filename with a new extension
+string output_name(char *filename, const char *ext) {
+    if (_outFile == NULL) return get_new_extension(filename, ext);
+
+    printf("%s\n", strcmp(_outFile, "-")==0 ? "stdout" : _outFile);
+    return string(_outFile);
+}
+
+static bool hasExtension(string name, const char *ext) {
+    size_t n = strlen(ext);
+    if (name.size() < n) return false;
+    for (size_t i=0; i<n; i++) {
+        if (tolower(name[name.size()-n+i]) != ext[i]) return false;
+    }
+    return true;
+}
+
+// True for outputs written row by row: raw, Cube and dense files, and stdout
+bool isRowFormatName(string name) {
+    return name == "-" || hasExtension(name, ".raw") || hasExtension(name, ".mat")
+        || DenseMatrix::isDenseName(name);
+}
+
+/*
+ * Create a raw or Cube matrix to write rows to.  "-" streams raw rows to
+ * stdout; otherwise .raw and .mat pick the format, and any other name
+ * follows -raw.
+ */
+MatrixSink* createRowSink(string name, int tables, int zones, vector<string> &tableNames) {
+    if (name == "-") {
+        MemMatrix *raw = new MemMatrix();
+        raw->createStream(tables, zones, tableNames, _streamOut);
+        return raw;
+    }
+
+    if (DenseMatrix::isDenseName(name)) {
+        DenseMatrix *dense = new DenseMatrix();
+        dense->createFile(tables, zones, tableNames, name, _denseValueSize);
+        return dense;
+    }
+
+    bool cube = hasExtension(name, ".mat") || (!hasExtension(name, ".raw") && !_rawOutput);
+    if (!cube) {
+        MemMatrix *raw = new MemMatrix();
+        raw->createFile(tables, zones, tableNames, name);
+        return raw;
+    }
+
+#ifdef _WIN32
+    vector<const char*> names;
+    for (int t=0; t<tables; t++) names.push_back(tableNames[t].c_str());
+
+    TPPMatrix *tpp = new TPPMatrix();
+    tpp->createFile(tables, zones, &names[0], name.c_str());
+    return tpp;
+#else
+    fprintf(stderr, "\n** Can't write Cube file %s; Cube files need the Windows build.\n", name.c_str());
+    return NULL;
+#endif
+}
+
+/*
+ * With -dense, write a .dmx file next to the output as well, from the same
+ * pass: a SinkTap at the end of the pipeline's transforms copies every block
+ * to it.  Returns NULL without -dense, or when the output is itself dense.
+ */
+SinkTap* addDenseExport(char *filename, string outName, int tables, int zones,
+                        vector<string> &tableNames, PipelineOptions &pipeline) {
+    if (!_denseExport || DenseMatrix::isDenseName(outName)) return NULL;
+
+    string base = (outName == "-") ? string(filename) : outName;
+    printf("  dense export: ");
+    string denseName = get_new_extension((char *) base.c_str(), ".dmx");
+
+    DenseMatrix *dense = new DenseMatrix();
+    try {
+        dense->createFile(tables, zones, tableNames, denseName, _denseValueSize);
+    } catch (DenseMatrix::FileOpenException&) {
+        delete dense;
+        throw;
+    }
+
+    SinkTap *tap = new SinkTap(dense, tables);
+    pipeline.transforms.push_back(tap);
+    return tap;
+}
+
+void finishDenseExport(SinkTap *tap) {
+    if (tap == NULL) return;
+    tap->getSink()->closeFile();
+    delete tap->getSink();
+    delete tap;
+}
 
 // Replace extension .mat with .h5 in filename, for example
 string get_new_extension(char *filename, const char* ext) {
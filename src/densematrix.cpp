@@ -0,0 +1,198 @@
+/* densematrix.cpp
+ *
+ * Dense, mmap-able export of matrix tables.
+ *
+ */
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include "densematrix.h"
+
+using namespace std;
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+static bool littleEndian() {
+    unsigned int one = 1;
+    return *(unsigned char *)&one == 1;
+}
+
+// Store the low <bytes> bytes of v at p, least significant first
+static void putLE(unsigned char *p, unsigned long long v, int bytes) {
+    for (int i=0; i<bytes; i++) {
+        p[i] = (unsigned char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+// ###########################################################################
+// DenseMatrix:  tables as page-aligned dense arrays in one file
+// ---------------------------------------------------------------------------
+
+DenseMatrix::DenseMatrix() {
+    _fileOpen = false;
+    _nTables = 0;
+    _nZones = 0;
+    _valueSize = 8;
+    _file = NULL;
+    _dataStart = 0;
+    _stride = 0;
+    _filePos = 0;
+}
+
+//Destructor
+DenseMatrix::~DenseMatrix()
+{
+    closeFile();
+}
+
+// By extension, .dmx in any case
+bool DenseMatrix::isDenseName(string fileName) {
+    size_t n = fileName.size();
+    if (n < 4) return false;
+    for (int i=0; i<4; i++) {
+        if (tolower(fileName[n-4+i]) != ".dmx"[i]) return false;
+    }
+    return true;
+}
+
+void DenseMatrix::createFile(int tables, int zones, vector<string> &tableNames,
+                             string fileName, int valueSize) {
+    if (_fileOpen == true)
+        throw InvalidOperationException();
+
+    if (valueSize != 8 && valueSize != 4) {
+        fprintf(stderr, "ERROR: dense values must be 4 or 8 bytes, not %d\n", valueSize);
+        throw InvalidOperationException();
+    }
+
+    _file = fopen(fileName.c_str(), "wb");
+    if (_file == NULL) {
+        fprintf(stderr, "ERROR: Could not create file %s.\n", fileName.c_str());
+        throw FileOpenException();
+    }
+
+    _fileOpen = true;
+    _nTables = tables;
+    _nZones = zones;
+    _valueSize = valueSize;
+
+    long long tableBytes = (long long)zones * zones * valueSize;
+    _stride = (tableBytes + DENSE_ALIGN - 1) / DENSE_ALIGN * DENSE_ALIGN;
+
+    writeHeader(tableNames);
+}
+
+void DenseMatrix::closeFile() {
+    if (_file == NULL) return;
+
+    // Pad the last table out to the full stride, so every table is mappable
+    long long end = _dataStart + _stride * _nTables;
+    if (_filePos < end) {
+        char zero = 0;
+        writeAt(end-1, &zero, 1);
+    }
+
+    if (0 != fclose(_file)) {
+        fprintf(stderr, "ERROR: writing dense file\n");
+        exit(2);
+    }
+    _file = NULL;
+    _fileOpen = false;
+}
+
+int DenseMatrix::getZones() {
+    return _nZones;
+}
+
+// Enough rows that each block is one large sequential write per table
+int DenseMatrix::getBlockRows() {
+    long long rowBytes = (long long)_nZones * _nTables * sizeof(double);
+    long long rows = DENSE_BLOCK_BYTES / (rowBytes > 0 ? rowBytes : 1);
+    if (rows < 1) rows = 1;
+    if (rows > _nZones) rows = _nZones;
+    return (int) rows;
+}
+
+void DenseMatrix::writeRow(int table, int row, double *rowptr) {
+    writeRows(table, row, 1, rowptr);
+}
+
+void DenseMatrix::writeRows(int table, int firstRow, int nRows, double *data) {
+    if (table < 1 || table > _nTables || firstRow < 1 || firstRow+nRows-1 > _nZones) {
+        fprintf(stderr, "ERROR: writing table %d, rows %d-%d\n", table, firstRow, firstRow+nRows-1);
+        exit(2);
+    }
+
+    size_t n = (size_t)nRows * _nZones;
+    _buf.resize(n * _valueSize);
+    unsigned char *out = &_buf[0];
+
+    if (_valueSize == 4) {
+        for (size_t i=0; i<n; i++) {
+            float f = (float) data[i];
+            unsigned int bits;
+            memcpy(&bits, &f, 4);
+            putLE(out + i*4, bits, 4);
+        }
+    } else if (littleEndian()) {
+        memcpy(out, data, n * sizeof(double));
+    } else {
+        for (size_t i=0; i<n; i++) {
+            unsigned long long bits;
+            memcpy(&bits, &data[i], 8);
+            putLE(out + i*8, bits, 8);
+        }
+    }
+
+    long long offset = _dataStart + (table-1) * _stride
+                     + (long long)(firstRow-1) * _nZones * _valueSize;
+    writeAt(offset, out, _buf.size());
+}
+
+// ---- Private functions ---------------------------------------------------
+
+// Seek only when we have to; zone-major writes jump between tables anyway
+void DenseMatrix::writeAt(long long offset, const void *data, size_t bytes) {
+    if (offset != _filePos && 0 != fseek64(_file, offset, SEEK_SET)) {
+        fprintf(stderr, "ERROR: Couldn't position dense file at %lld\n", offset);
+        exit(2);
+    }
+    if (fwrite(data, 1, bytes, _file) != bytes) {
+        fprintf(stderr, "ERROR: writing dense file at %lld\n", offset);
+        exit(2);
+    }
+    _filePos = offset + bytes;
+}
+
+void DenseMatrix::writeHeader(vector<string> &tableNames) {
+    string names;
+    for (int t=0; t<_nTables; t++) {
+        names += tableNames[t];
+        names.push_back('\0');
+    }
+
+    int fixed = DENSE_MAGIC_LEN + 4*4 + 2*8;
+    _dataStart = ((long long)fixed + names.size() + DENSE_ALIGN - 1) / DENSE_ALIGN * DENSE_ALIGN;
+
+    vector<unsigned char> header(_dataStart, 0);
+    unsigned char *p = &header[0];
+
+    memcpy(p, DENSE_MAGIC, DENSE_MAGIC_LEN);
+    putLE(p+8,  _nZones, 4);
+    putLE(p+12, _nTables, 4);
+    putLE(p+16, _valueSize, 4);
+    putLE(p+20, DENSE_ALIGN, 4);
+    putLE(p+24, _dataStart, 8);
+    putLE(p+32, _stride, 8);
+    memcpy(p + fixed, names.data(), names.size());
+
+    _filePos = 0;
+    writeAt(0, p, header.size());
+}
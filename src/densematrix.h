@@ -0,0 +1,81 @@
+/* densematrix.h
+ *
+ * Dense export: every table as an uncompressed array that other tools can
+ * mmap directly, with no parse step.
+ *
+ * File layout (always little-endian):
+ *
+ *   char[8]   magic "MTXDNS01"
+ *   int32     zones
+ *   int32     tables
+ *   int32     value size in bytes: 8 = float64, 4 = float32 (IEEE 754)
+ *   int32     alignment in bytes (65536)
+ *   int64     file offset of table 1
+ *   int64     table stride in bytes (table t starts at offset + (t-1)*stride)
+ *   char[]    table names, each NUL-terminated, NUL-padded to the offset
+ *   values    each table as zones x zones values, row-major, padded
+ *             to the stride
+ *
+ * Tables start on 64 KB boundaries, which suits both mmap() and Windows
+ * MapViewOfFile(), so a single table can be mapped on its own.  Rows are
+ * written in place as they arrive, so nothing is buffered per table.
+ */
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "matrixio.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef DENSEMATRIX_H
+#define DENSEMATRIX_H
+
+#define DENSE_MAGIC       "MTXDNS01"
+#define DENSE_MAGIC_LEN   8
+#define DENSE_ALIGN       65536
+#define DENSE_BLOCK_BYTES (16*1024*1024)   // rows per write, across all tables
+
+class DenseMatrix : public MatrixSink {
+public:
+    DenseMatrix();
+    virtual  ~DenseMatrix();
+
+    // valueSize 8 writes float64, 4 writes float32
+    void     createFile(int tables, int zones, vector<string> &tableNames,
+                        string fileName, int valueSize);
+    void     closeFile();
+
+    int      getZones();
+    int      getBlockRows();
+    void     writeRow(int table, int row, double *rowptr);
+    void     writeRows(int table, int firstRow, int nRows, double *data);
+
+    static bool isDenseName(string fileName);
+
+    //Nested exception classes
+    class    FileOpenException { };
+    class    InvalidOperationException { };
+
+//--------------------------------------------------------------------
+private:
+    //Data
+    int      _nZones;
+    int      _nTables;
+    int      _valueSize;
+    bool     _fileOpen;
+
+    FILE*    _file;
+    long long _dataStart;
+    long long _stride;
+    long long _filePos;
+
+    vector<unsigned char> _buf;     // values in file format
+
+    //Methods
+    void     writeHeader(vector<string> &tableNames);
+    void     writeAt(long long offset, const void *data, size_t bytes);
+};
+
+#endif /* DENSEMATRIX_H */
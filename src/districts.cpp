@@ -0,0 +1,141 @@
+/* districts.cpp
+ *
+ * Streaming zone-to-district aggregation.
+ *
+ */
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+#include "districts.h"
+#include "zonesubset.h"
+
+using namespace std;
+
+// ###########################################################################
+// DistrictSums:  district totals of the rows written to it
+// ---------------------------------------------------------------------------
+
+DistrictSums::DistrictSums(vector<int> &zoneDistrict, int tables) {
+    _nZones = zoneDistrict.size();
+    _nTables = tables;
+
+    // Number the districts 1.. in order of their own numbers
+    map<int,int> index;
+    for (int z=0; z<_nZones; z++) {
+        if (zoneDistrict[z] > 0) index[zoneDistrict[z]] = 0;
+    }
+    for (map<int,int>::iterator it = index.begin(); it != index.end(); it++) {
+        it->second = _numbers.size();
+        _numbers.push_back(it->first);
+    }
+
+    _rowDistrict.assign(_nZones, -1);
+    for (int z=0; z<_nZones; z++) {
+        if (zoneDistrict[z] > 0) _rowDistrict[z] = index[zoneDistrict[z]];
+    }
+    buildRuns(_rowDistrict, _runs);
+
+    size_t d = _numbers.size();
+    _sums.assign(tables, vector<double>(d*d, 0.0));
+}
+
+int DistrictSums::getZones() {
+    return _nZones;
+}
+
+// Blocks of a few MB rather than single rows, to keep pipeline overhead down
+int DistrictSums::getBlockRows() {
+    long long rowBytes = (long long)_nZones * _nTables * sizeof(double);
+    long long rows = DISTRICT_BLOCK_BYTES / (rowBytes > 0 ? rowBytes : 1);
+    if (rows < 1) rows = 1;
+    if (rows > _nZones) rows = _nZones;
+    return (int) rows;
+}
+
+int DistrictSums::getDistricts() {
+    return _numbers.size();
+}
+
+vector<int>& DistrictSums::getDistrictNumbers() {
+    return _numbers;
+}
+
+// Columns are summed run by run: zones numbered by district make long runs
+void DistrictSums::writeRow(int table, int row, double *rowptr) {
+    int d = _rowDistrict[row-1];
+    if (d < 0) return;
+
+    sumRuns(rowptr, _runs, &_sums[table-1][(size_t)d * _numbers.size()]);
+}
+
+void DistrictSums::closeFile() {
+}
+
+void DistrictSums::getMatrix(MemMatrix &matrix, vector<string> &tableNames) {
+    int d = _numbers.size();
+    matrix.create(_nTables, d, tableNames);
+    for (int t=1; t<=_nTables; t++) {
+        for (int r=1; r<=d; r++) {
+            matrix.writeRow(t, r, &_sums[t-1][(size_t)(r-1) * d]);
+        }
+    }
+}
+
+bool DistrictSums::readEquivalency(const char *fileName, int zones, vector<int> &zoneDistrict) {
+    FILE *f = fopen(fileName, "r");
+    if (f == NULL) {
+        fprintf(stderr, "\n** Cannot open equivalency file %s\n", fileName);
+        return false;
+    }
+
+    zoneDistrict.assign(zones, 0);
+    bool ok = true;
+    char line[65536];
+    int lineNo = 0;
+
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineNo++;
+        char *comment = strchr(line, ';');
+        if (comment) *comment = '\0';
+
+        char *end;
+        long district = strtol(line, &end, 10);
+        if (end == line) {
+            for (char *c = line; *c; c++) {
+                if (!isspace((unsigned char)*c)) ok = false;
+            }
+            if (!ok) fprintf(stderr, "\n** %s line %d: expected a district number\n", fileName, lineNo);
+            continue;
+        }
+
+        ZoneRanges ranges;
+        vector<int> list;
+        int bad;
+        if (district < 1 || !ZoneSubset::parseZoneList(end, ranges)) {
+            fprintf(stderr, "\n** %s line %d: bad district or zone list\n", fileName, lineNo);
+            ok = false;
+            continue;
+        }
+        if (!ZoneSubset::expandZoneList(ranges, zones, list, bad)) {
+            fprintf(stderr, "\n** %s line %d: zone %d is out of range\n", fileName, lineNo, bad);
+            ok = false;
+            continue;
+        }
+        for (unsigned int i=0; i<list.size(); i++) {
+            int z = list[i];
+            if (zoneDistrict[z-1] != 0 && zoneDistrict[z-1] != district) {
+                fprintf(stderr, "\n** %s line %d: zone %d is already in district %d\n",
+                        fileName, lineNo, z, zoneDistrict[z-1]);
+                ok = false;
+            } else {
+                zoneDistrict[z-1] = district;
+            }
+        }
+    }
+    fclose(f);
+    return ok;
+}
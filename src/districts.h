@@ -0,0 +1,63 @@
+/* districts.h
+ *
+ * Zone-to-district aggregation as rows stream through copy_data().
+ *
+ * DistrictSums is a sink that sums every row it is given into its origin's
+ * district, and the row's columns into their destination districts.  The
+ * district totals are small, so they are held in memory and handed on as
+ * a MemMatrix once the pass is over.
+ *
+ * Equivalency file: one district per line, as the district number and then
+ * its zones, e.g.
+ *
+ *   1  1-25,31
+ *   2  26-30 32
+ *
+ * Zone lists take the same ranges as -zones.  Zones in no district are
+ * left out of the totals; text after ';' is a comment.  Districts are
+ * numbered 1.. in the output, in ascending order of their numbers.
+ */
+#include <string>
+#include <vector>
+
+#include "matrixio.h"
+#include "memmatrix.h"
+#include "kernels.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef DISTRICTS_H
+#define DISTRICTS_H
+
+#define  DISTRICT_BLOCK_BYTES  (4*1024*1024)   // rows per block, across all tables
+
+class DistrictSums : public MatrixSink {
+public:
+    // zoneDistrict[z-1] is zone z's district number, or 0 for none
+    DistrictSums(vector<int> &zoneDistrict, int tables);
+
+    int      getZones();
+    int      getBlockRows();
+    int      getDistricts();
+    vector<int>& getDistrictNumbers();  // output district i is number [i-1]
+
+    void     writeRow(int table, int row, double *rowptr);
+    void     closeFile();
+
+    // The totals so far, as an in-memory matrix
+    void     getMatrix(MemMatrix &matrix, vector<string> &tableNames);
+
+    // Fills zoneDistrict for zones 1..zones; returns false on errors
+    static bool readEquivalency(const char *fileName, int zones, vector<int> &zoneDistrict);
+
+private:
+    int      _nZones;
+    int      _nTables;
+    vector<int> _rowDistrict;       // origin zone -> output district from 0, or -1
+    vector<int> _numbers;
+    vector<ZoneRun> _runs;          // destination zones -> output districts
+    vector< vector<double> > _sums; // per table, districts x districts
+};
+
+#endif /* DISTRICTS_H */
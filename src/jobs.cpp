@@ -0,0 +1,209 @@
+/* jobs.cpp
+ *
+ * Convert several files at once, each in its own worker process.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "jobs.h"
+
+using namespace std;
+
+struct Job {
+    char*    file;
+    FILE*    log;
+#ifdef _WIN32
+    string   logName;
+    HANDLE   process;
+#else
+    pid_t    pid;
+#endif
+};
+
+#ifdef _WIN32
+
+// Windows command lines are re-parsed by the child, so quote anything with spaces
+static char* quoteArg(const char *arg) {
+    string s(arg);
+    if (s.find_first_of(" \t") != string::npos) s = "\"" + s + "\"";
+    return strdup(s.c_str());
+}
+
+static Job startJob(char *file, char *program, vector<char*> &options, ConvertFunc convert) {
+    Job job;
+    char dir[MAX_PATH], name[MAX_PATH];
+
+    job.file = file;
+    job.log = NULL;
+
+    GetTempPath(MAX_PATH, dir);
+    GetTempFileName(dir, "c2o", 0, name);
+    job.logName = name;
+
+    vector<char*> args;
+    args.push_back(quoteArg(program));
+    for (unsigned int i=0; i<options.size(); i++) args.push_back(quoteArg(options[i]));
+    args.push_back(quoteArg("-log"));
+    args.push_back(quoteArg(name));
+    args.push_back(quoteArg(file));
+    args.push_back(NULL);
+
+    intptr_t h = _spawnv(_P_NOWAIT, program, &args[0]);
+    for (unsigned int i=0; i+1<args.size(); i++) free(args[i]);
+
+    if (h == -1) {
+        fprintf(stderr, "\n** Could not start worker for %s\n", file);
+        job.process = NULL;
+    } else {
+        job.process = (HANDLE) h;
+    }
+    return job;
+}
+
+// Wait for any worker to finish; returns its index and sets its exit status
+static int waitJob(vector<Job> &running, int &status) {
+    vector<HANDLE> handles;
+    for (unsigned int i=0; i<running.size(); i++) {
+        if (running[i].process == NULL) {
+            status = -1;
+            return i;
+        }
+        handles.push_back(running[i].process);
+    }
+
+    DWORD w = WaitForMultipleObjects(handles.size(), &handles[0], FALSE, INFINITE);
+    int j = w - WAIT_OBJECT_0;
+
+    DWORD code = 1;
+    GetExitCodeProcess(running[j].process, &code);
+    CloseHandle(running[j].process);
+    status = code;
+
+    running[j].log = fopen(running[j].logName.c_str(), "r");
+    return j;
+}
+
+static void closeLog(Job &job) {
+    if (job.log != NULL) fclose(job.log);
+    remove(job.logName.c_str());
+}
+
+#else
+
+static Job startJob(char *file, char *program, vector<char*> &options, ConvertFunc convert) {
+    Job job;
+    job.file = file;
+    job.log = tmpfile();
+
+    // Don't let the child inherit (and repeat) our buffered output
+    fflush(stdout);
+    fflush(stderr);
+
+    job.pid = fork();
+    if (job.pid == 0) {
+        if (job.log != NULL) {
+            dup2(fileno(job.log), fileno(stdout));
+            dup2(fileno(job.log), fileno(stderr));
+            setvbuf(stdout, NULL, _IONBF, 0);
+        }
+        int v = convert(file);
+        fflush(stdout);
+        fflush(stderr);
+        exit(v ? 1 : 0);
+    }
+
+    if (job.pid < 0) {
+        fprintf(stderr, "\n** Could not start worker for %s\n", file);
+    }
+    return job;
+}
+
+// Wait for any worker to finish; returns its index and sets its exit status
+static int waitJob(vector<Job> &running, int &status) {
+    for (unsigned int i=0; i<running.size(); i++) {
+        if (running[i].pid < 0) {
+            status = -1;
+            return i;
+        }
+    }
+
+    while (true) {
+        int wstatus;
+        pid_t pid = waitpid(-1, &wstatus, 0);
+        if (pid < 0) {
+            status = -1;
+            return 0;
+        }
+
+        for (unsigned int i=0; i<running.size(); i++) {
+            if (running[i].pid == pid) {
+                status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+                if (running[i].log != NULL) rewind(running[i].log);
+                return i;
+            }
+        }
+    }
+}
+
+static void closeLog(Job &job) {
+    if (job.log != NULL) fclose(job.log);
+}
+
+#endif
+
+// Copy a finished worker's log to our stdout in one piece
+static void printLog(Job &job) {
+    char buf[4096];
+    size_t n;
+
+    if (job.log == NULL) return;
+    while ((n = fread(buf, 1, sizeof(buf), job.log)) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    fflush(stdout);
+}
+
+int runJobs(vector<char*> &files, int jobs, char *program,
+            vector<char*> &options, ConvertFunc convert) {
+    int errors = 0;
+    unsigned int next = 0;
+    vector<Job> running;
+
+    printf("\nConverting %d files, %d at a time\n", (int)files.size(), jobs);
+
+    while (next < files.size() || !running.empty()) {
+        while ((int)running.size() < jobs && next < files.size()) {
+            running.push_back(startJob(files[next++], program, options, convert));
+        }
+
+        int status;
+        int j = waitJob(running, status);
+        Job &job = running[j];
+
+        printLog(job);
+        closeLog(job);
+
+        // Exit status 1 means the worker already reported the failure
+        if (status != 0) {
+            if (status != 1) printf("\n>> Failed to convert %s.", job.file);
+            errors++;
+        }
+
+        running.erase(running.begin() + j);
+    }
+
+    return errors;
+}
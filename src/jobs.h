@@ -0,0 +1,25 @@
+/* jobs.h
+ *
+ * Convert several files at once, each in its own worker process.
+ *
+ * HDF5 is not thread-safe, so concurrent conversions need separate
+ * processes.  Each worker's output goes to a private log, which is
+ * printed in one piece when the worker finishes.
+ */
+#include <vector>
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef JOBS_H
+#define JOBS_H
+
+typedef int (*ConvertFunc)(char *filename);
+
+// Convert files with up to <jobs> workers; returns the number of failures.
+// On Windows workers are started as "program options... -log <file> <input>";
+// elsewhere they are forked and call convert() directly.
+int runJobs(vector<char*> &files, int jobs, char *program,
+            vector<char*> &options, ConvertFunc convert);
+
+#endif /* JOBS_H */
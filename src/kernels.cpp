@@ -0,0 +1,298 @@
+/* kernels.cpp
+ *
+ * Vectorized per-row kernels.
+ *
+ */
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
+#include <cmath>
+#include <cstring>
+
+#include "kernels.h"
+
+using namespace std;
+
+void buildRuns(vector<int> &target, vector<ZoneRun> &runs) {
+    runs.clear();
+    int n = target.size();
+
+    for (int j=0; j<n; ) {
+        if (target[j] < 0) {
+            j++;
+            continue;
+        }
+        ZoneRun run;
+        run.start = j;
+        run.target = target[j];
+        while (j < n && target[j] == run.target) j++;
+        run.length = j - run.start;
+        runs.push_back(run);
+    }
+}
+
+void sumRuns(const double *row, vector<ZoneRun> &runs, double *out) {
+    for (unsigned int i=0; i<runs.size(); i++) {
+        out[runs[i].target] += sumValues(row + runs[i].start, runs[i].length);
+    }
+}
+
+// Four independent partial sums, so the adds pipeline
+double sumValues(const double *x, int n) {
+    int i = 0;
+#ifdef HAVE_SSE2
+    __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+    for (; i+4 <= n; i+=4) {
+        a0 = _mm_add_pd(a0, _mm_loadu_pd(x+i));
+        a1 = _mm_add_pd(a1, _mm_loadu_pd(x+i+2));
+    }
+    a0 = _mm_add_pd(a0, a1);
+    double lanes[2];
+    _mm_storeu_pd(lanes, a0);
+    double sum = lanes[0] + lanes[1];
+#else
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (; i+4 <= n; i+=4) {
+        s0 += x[i];
+        s1 += x[i+1];
+        s2 += x[i+2];
+        s3 += x[i+3];
+    }
+    double sum = (s0 + s1) + (s2 + s3);
+#endif
+    for (; i<n; i++) sum += x[i];
+    return sum;
+}
+
+// Checks eight values at a time, and stops at the first nonzero group
+bool allZero(const double *x, size_t n) {
+    size_t i = 0;
+#ifdef HAVE_SSE2
+    __m128d zero = _mm_setzero_pd();
+    for (; i+8 <= n; i+=8) {
+        __m128d ne = _mm_or_pd(
+            _mm_or_pd(_mm_cmpneq_pd(_mm_loadu_pd(x+i), zero), _mm_cmpneq_pd(_mm_loadu_pd(x+i+2), zero)),
+            _mm_or_pd(_mm_cmpneq_pd(_mm_loadu_pd(x+i+4), zero), _mm_cmpneq_pd(_mm_loadu_pd(x+i+6), zero)));
+        if (_mm_movemask_pd(ne) != 0) return false;
+    }
+#endif
+    for (; i<n; i++) {
+        if (!(x[i] == 0.0)) return false;
+    }
+    return true;
+}
+
+// Same test as valuesMatch, two values at a time.  maxpd returns its
+// second operand when the first is NaN, so NaN differences drop out of
+// the maximum.
+int compareValues(const double *a, const double *b, int n, double atol, double rtol,
+                  double &maxDiff) {
+    int i = 0, bad = 0;
+    double hi = maxDiff;
+#ifdef HAVE_SSE2
+    __m128d sign = _mm_set1_pd(-0.0), inf = _mm_set1_pd(HUGE_VAL);
+    __m128d vatol = _mm_set1_pd(atol), vrtol = _mm_set1_pd(rtol);
+    __m128d vmax = _mm_set1_pd(maxDiff);
+    for (; i+2 <= n; i+=2) {
+        __m128d x = _mm_loadu_pd(a+i);
+        __m128d y = _mm_loadu_pd(b+i);
+        __m128d d = _mm_andnot_pd(sign, _mm_sub_pd(x, y));
+        __m128d tol = _mm_add_pd(vatol, _mm_mul_pd(vrtol, _mm_andnot_pd(sign, x)));
+
+        __m128d ok = _mm_or_pd(
+            _mm_or_pd(_mm_cmpeq_pd(x, y), _mm_and_pd(_mm_cmpunord_pd(x, x), _mm_cmpunord_pd(y, y))),
+            _mm_and_pd(_mm_cmple_pd(d, tol), _mm_cmplt_pd(d, inf)));
+        int mask = _mm_movemask_pd(ok) ^ 3;
+        bad += (mask & 1) + (mask >> 1);
+        vmax = _mm_max_pd(d, vmax);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, vmax);
+    hi = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+#endif
+    for (; i<n; i++) {
+        if (!valuesMatch(a[i], b[i], atol, rtol)) bad++;
+        double d = fabs(a[i] - b[i]);
+        if (d > hi) hi = d;
+    }
+    maxDiff = hi;
+    return bad;
+}
+
+// NaN lanes are masked out of the sums, and dropped from the maximum by
+// maxpd's second-operand rule, as in compareValues
+double diffValues(const double *a, const double *b, double *d, int n, double threshold,
+                  DiffStats &stats) {
+    int i = 0;
+    double hi = 0, sum = 0, sumSq = 0;
+    long long over = 0, nans = 0;
+#ifdef HAVE_SSE2
+    __m128d sign = _mm_set1_pd(-0.0), thr = _mm_set1_pd(threshold);
+    __m128d vmax = _mm_setzero_pd(), vsum = _mm_setzero_pd(), vsq = _mm_setzero_pd();
+    for (; i+2 <= n; i+=2) {
+        __m128d x = _mm_sub_pd(_mm_loadu_pd(b+i), _mm_loadu_pd(a+i));
+        _mm_storeu_pd(d+i, x);
+
+        __m128d nan = _mm_cmpunord_pd(x, x);
+        __m128d valid = _mm_andnot_pd(nan, x);
+        __m128d ax = _mm_andnot_pd(sign, x);
+        vmax = _mm_max_pd(ax, vmax);
+        vsum = _mm_add_pd(vsum, valid);
+        vsq = _mm_add_pd(vsq, _mm_mul_pd(valid, valid));
+
+        int mask = _mm_movemask_pd(_mm_cmpgt_pd(ax, thr));
+        over += (mask & 1) + (mask >> 1);
+        mask = _mm_movemask_pd(nan);
+        nans += (mask & 1) + (mask >> 1);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, vmax);  hi = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    _mm_storeu_pd(lanes, vsum);  sum = lanes[0] + lanes[1];
+    _mm_storeu_pd(lanes, vsq);   sumSq = lanes[0] + lanes[1];
+#endif
+    for (; i<n; i++) {
+        double x = b[i] - a[i];
+        d[i] = x;
+        if (x != x) {
+            nans++;
+            continue;
+        }
+        double ax = fabs(x);
+        if (ax > hi) hi = ax;
+        if (ax > threshold) over++;
+        sum += x;
+        sumSq += x*x;
+    }
+
+    if (hi > stats.maxAbs) stats.maxAbs = hi;
+    stats.sum += sum;
+    stats.sumSquares += sumSq;
+    stats.over += over;
+    stats.nans += nans;
+    return hi;
+}
+
+static const unsigned long long PRIME1 = 11400714785074694791ULL;
+static const unsigned long long PRIME2 = 14029467366897019727ULL;
+static const unsigned long long PRIME3 = 1609587929392839161ULL;
+static const unsigned long long PRIME4 = 9650029242287828579ULL;
+static const unsigned long long PRIME5 = 2870177450012600261ULL;
+
+static inline unsigned long long rotl64(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long hashRound(unsigned long long acc, unsigned long long v) {
+    return rotl64(acc + v * PRIME2, 31) * PRIME1;
+}
+
+// Four independent lanes over 32 bytes at a time, then the tail, then a
+// final mix so every input bit reaches every output bit
+unsigned long long hashValues(const double *x, int n, unsigned long long seed) {
+    unsigned long long w[4], h;
+    int i = 0;
+
+    if (n >= 4) {
+        unsigned long long v1 = seed + PRIME1 + PRIME2, v2 = seed + PRIME2;
+        unsigned long long v3 = seed, v4 = seed - PRIME1;
+        for (; i+4 <= n; i+=4) {
+            memcpy(w, x+i, sizeof(w));
+            v1 = hashRound(v1, w[0]);
+            v2 = hashRound(v2, w[1]);
+            v3 = hashRound(v3, w[2]);
+            v4 = hashRound(v4, w[3]);
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    } else {
+        h = seed + PRIME5;
+    }
+
+    h += (unsigned long long) n * sizeof(double);
+    for (; i<n; i++) {
+        memcpy(w, x+i, sizeof(double));
+        h = rotl64(h ^ hashRound(0, w[0]), 27) * PRIME1 + PRIME4;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+void addValues(const double *in, int n, double *out) {
+    int i = 0;
+#ifdef HAVE_SSE2
+    for (; i+2 <= n; i+=2) {
+        _mm_storeu_pd(out+i, _mm_add_pd(_mm_loadu_pd(out+i), _mm_loadu_pd(in+i)));
+    }
+#endif
+    for (; i<n; i++) out[i] += in[i];
+}
+
+/*
+ * One vector pass for sum, min, max and nonzeros.  A row whose sum isn't
+ * finite holds a NaN or Inf (or overflowed), and is redone value by value
+ * so those can be counted and left out.
+ */
+double scanRow(const double *row, int n, ValueStats &stats, double *colSums) {
+    int i = 0;
+    double sum, lo, hi, nonzero;
+#ifdef HAVE_SSE2
+    __m128d vsum = _mm_setzero_pd(), vnz = _mm_setzero_pd();
+    __m128d vlo = _mm_set1_pd(HUGE_VAL), vhi = _mm_set1_pd(-HUGE_VAL);
+    __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+    for (; i+2 <= n; i+=2) {
+        __m128d x = _mm_loadu_pd(row+i);
+        vsum = _mm_add_pd(vsum, x);
+        vlo = _mm_min_pd(vlo, x);
+        vhi = _mm_max_pd(vhi, x);
+        vnz = _mm_add_pd(vnz, _mm_and_pd(_mm_cmpneq_pd(x, zero), one));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, vsum);  sum = lanes[0] + lanes[1];
+    _mm_storeu_pd(lanes, vlo);   lo = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    _mm_storeu_pd(lanes, vhi);   hi = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    _mm_storeu_pd(lanes, vnz);   nonzero = lanes[0] + lanes[1];
+#else
+    sum = 0; lo = HUGE_VAL; hi = -HUGE_VAL; nonzero = 0;
+#endif
+    for (; i<n; i++) {
+        double x = row[i];
+        sum += x;
+        if (x < lo) lo = x;
+        if (x > hi) hi = x;
+        if (x != 0) nonzero++;
+    }
+
+    if (std::isfinite(sum)) {
+        addValues(row, n, colSums);
+        stats.sum += sum;
+        if (lo < stats.min) stats.min = lo;
+        if (hi > stats.max) stats.max = hi;
+        stats.nonzero += (long long) nonzero;
+        return sum;
+    }
+
+    sum = 0;
+    for (i=0; i<n; i++) {
+        double x = row[i];
+        if (std::isnan(x)) {
+            stats.nans++;
+        } else if (std::isinf(x)) {
+            stats.infs++;
+        } else {
+            sum += x;
+            colSums[i] += x;
+            if (x < stats.min) stats.min = x;
+            if (x > stats.max) stats.max = x;
+            if (x != 0) stats.nonzero++;
+        }
+    }
+    stats.sum += sum;
+    return sum;
+}
@@ -0,0 +1,89 @@
+/* kernels.h
+ *
+ * Inner loops that run once per row per table.  They use SSE2 where the
+ * compiler targets it (always on x86-64), and plain loops otherwise.
+ */
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef KERNELS_H
+#define KERNELS_H
+
+// Consecutive zones start..start+length-1 (from 0) that all go to target
+struct ZoneRun {
+    int      start;
+    int      length;
+    int      target;
+};
+
+// Runs of consecutive zones with the same target; zones with target < 0
+// are left out
+void     buildRuns(vector<int> &target, vector<ZoneRun> &runs);
+
+// For each run, out[run.target] += the run's values in row
+void     sumRuns(const double *row, vector<ZoneRun> &runs, double *out);
+
+// Sum of x[0..n-1]
+double   sumValues(const double *x, int n);
+
+// True if every x[0..n-1] is 0.0 (or -0.0); NaN counts as nonzero
+bool     allZero(const double *x, size_t n);
+
+// True if b is within atol + rtol*|a| of a.  NaN matches only NaN, and an
+// infinity only itself.
+inline bool valuesMatch(double a, double b, double atol, double rtol) {
+    if (a == b) return true;
+    if (a != a) return b != b;
+    double d = fabs(a - b);
+    return d <= atol + rtol * fabs(a) && d < HUGE_VAL;
+}
+
+// Number of i in 0..n-1 where b[i] doesn't match a[i] (see valuesMatch);
+// maxDiff is raised to the largest |a[i]-b[i]| that isn't NaN
+int      compareValues(const double *a, const double *b, int n, double atol, double rtol,
+                       double &maxDiff);
+
+// Running statistics of differences; NaN differences are only counted
+struct DiffStats {
+    double   maxAbs;
+    double   sum;
+    double   sumSquares;
+    long long over;        // |difference| > threshold
+    long long nans;
+
+    DiffStats() : maxAbs(0), sum(0), sumSquares(0), over(0), nans(0) {}
+};
+
+// d[i] = b[i] - a[i] for i in 0..n-1, added to stats; d may be b.
+// Returns the largest |d[i]| that isn't NaN.
+double   diffValues(const double *a, const double *b, double *d, int n, double threshold,
+                    DiffStats &stats);
+
+// 64-bit hash of the bits of x[0..n-1], in the style of xxHash64.  Fast
+// enough to run on every row; not for security.
+unsigned long long hashValues(const double *x, int n, unsigned long long seed);
+
+// out[i] += in[i] for i in 0..n-1
+void     addValues(const double *in, int n, double *out);
+
+// Running statistics of finite values; NaN and Inf are only counted
+struct ValueStats {
+    double   sum;
+    double   min;
+    double   max;
+    long long nonzero;
+    long long nans;
+    long long infs;
+
+    ValueStats() : sum(0), min(HUGE_VAL), max(-HUGE_VAL), nonzero(0), nans(0), infs(0) {}
+};
+
+// Add row[0..n-1] to stats, and each value to colSums[j].  Returns the sum
+// of the row's finite values.
+double   scanRow(const double *row, int n, ValueStats &stats, double *colSums);
+
+#endif /* KERNELS_H */
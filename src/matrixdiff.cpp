@@ -0,0 +1,109 @@
+/* matrixdiff.cpp
+ *
+ * Streaming difference statistics of two matrices.
+ *
+ */
+
+#include <cmath>
+
+#include "matrixdiff.h"
+
+using namespace std;
+
+// ###########################################################################
+// DiffSink:  compares rows written to it with another matrix
+// ---------------------------------------------------------------------------
+
+DiffSink::DiffSink(MatrixSource *other, vector<int> &order, long long band, double threshold,
+                   int worst, MatrixSink *delta) {
+    _other = other;
+    _delta = delta;
+    _order = order;
+    _nZones = other->getZones();
+    _band = band;
+    _threshold = threshold;
+    _nWorst = worst > 0 ? worst : 0;
+    _results.resize(order.size());
+}
+
+int DiffSink::getZones() {
+    return _nZones;
+}
+
+// A few MB of rows, in whole bands if one fits.  Otherwise blocks cut
+// through chunks, and the chunk caches keep the rest for the next block.
+int DiffSink::getBlockRows() {
+    long long rowBytes = (long long)_nZones * _order.size() * sizeof(double);
+    long long rows = DIFF_BLOCK_BYTES / (rowBytes > 0 ? rowBytes : 1);
+
+    if (_band > 0 && rows >= _band) rows -= rows % _band;
+    if (rows < 1) rows = 1;
+    if (rows > _nZones) rows = _nZones;
+    return (int) rows;
+}
+
+bool DiffSink::usesHDF5() {
+    return _other->usesHDF5() || (_delta != NULL && _delta->usesHDF5());
+}
+
+void DiffSink::writeRow(int table, int row, double *rowptr) {
+    writeRows(table, row, 1, rowptr);
+}
+
+/*
+ * Statistics in one vector pass per row, which also leaves the differences
+ * for the delta file.  Only rows whose largest difference would make the
+ * worst list are looked at again.
+ */
+void DiffSink::writeRows(int table, int firstRow, int nRows, double *data) {
+    TableDiff &diff = _results[table-1];
+    size_t n = (size_t)nRows * _nZones;
+
+    _buf.resize(n);
+    _diff.resize(n);
+    _other->getRows(_order[table-1], firstRow, nRows, &_buf[0]);
+
+    for (int r=0; r<nRows; r++) {
+        size_t offset = (size_t)r * _nZones;
+        const double *base = data + offset;
+
+        double rowMax = diffValues(base, &_buf[offset], &_diff[offset], _nZones, _threshold, diff.stats);
+        diff.cells += _nZones;
+
+        if (_nWorst > 0 && rowMax > 0 &&
+            (diff.worst.size() < _nWorst || rowMax > fabs(diff.worst.back().diff))) {
+            addWorst(diff, firstRow + r, base, &_buf[offset], &_diff[offset]);
+        }
+    }
+
+    if (_delta != NULL) _delta->writeRows(table, firstRow, nRows, &_diff[0]);
+}
+
+// Insert the row's cells into the sorted worst list, keeping _nWorst
+void DiffSink::addWorst(TableDiff &diff, int orig, const double *base, const double *other,
+                        const double *delta) {
+    vector<ODPair> &worst = diff.worst;
+
+    for (int j=0; j<_nZones; j++) {
+        double d = fabs(delta[j]);
+        if (!(d > 0)) continue;
+        if (worst.size() == _nWorst && !(d > fabs(worst.back().diff))) continue;
+
+        ODPair p = { orig, j+1, base[j], other[j], delta[j] };
+        unsigned int i = worst.size();
+        if (i < _nWorst) worst.push_back(p);
+        else i--;
+        while (i > 0 && fabs(worst[i-1].diff) < d) {
+            worst[i] = worst[i-1];
+            i--;
+        }
+        worst[i] = p;
+    }
+}
+
+void DiffSink::closeFile() {
+}
+
+TableDiff& DiffSink::getResult(int table) {
+    return _results[table-1];
+}
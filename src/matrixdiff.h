@@ -0,0 +1,76 @@
+/* matrixdiff.h
+ *
+ * Difference statistics between two matrices with the same zones, e.g.
+ * skims from two scenario runs.
+ *
+ * DiffSink is a sink: the base matrix is copied into it with copy_data(),
+ * and for every block it reads the same rows of the other matrix, so both
+ * are streamed in blocks and neither is held in memory.  Blocks are a
+ * whole number of both files' chunk bands when that fits DIFF_BLOCK_BYTES
+ * (see the constructor), so each chunk of either file is read once even
+ * when their chunk shapes differ.
+ */
+#include <vector>
+
+#include "matrixio.h"
+#include "kernels.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef MATRIXDIFF_H
+#define MATRIXDIFF_H
+
+#define  DIFF_BLOCK_BYTES  (16*1024*1024)    // rows per block, across all tables
+
+struct ODPair {
+    int      orig;         // from 1
+    int      dest;
+    double   base;
+    double   other;
+    double   diff;         // other - base
+};
+
+struct TableDiff {
+    DiffStats stats;       // of other - base
+    long long cells;
+    vector<ODPair> worst;  // largest |other - base| first
+
+    TableDiff() : cells(0) {}
+};
+
+class DiffSink : public MatrixSink {
+public:
+    // Rows of sink table t are the base, compared with table order[t-1] of
+    // other.  Blocks are whole multiples of band rows if one fits the
+    // budget; 0 = no alignment.  With a delta sink, other - base is
+    // written to its table t.
+    DiffSink(MatrixSource *other, vector<int> &order, long long band, double threshold,
+             int worst, MatrixSink *delta);
+
+    int      getZones();
+    int      getBlockRows();
+    bool     usesHDF5();
+    void     writeRow(int table, int row, double *rowptr);
+    void     writeRows(int table, int firstRow, int nRows, double *data);
+    void     closeFile();
+
+    TableDiff& getResult(int table);
+
+private:
+    MatrixSource *_other;
+    MatrixSink *_delta;
+    vector<int> _order;
+    int      _nZones;
+    long long _band;
+    double   _threshold;
+    unsigned int _nWorst;
+    vector<TableDiff> _results;
+    vector<double> _buf;            // the other matrix's rows
+    vector<double> _diff;           // other - base
+
+    void     addWorst(TableDiff &diff, int orig, const double *base, const double *other,
+                      const double *delta);
+};
+
+#endif /* MATRIXDIFF_H */
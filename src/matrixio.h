@@ -0,0 +1,107 @@
+/* matrixio.h
+ *
+ * Abstract row-oriented matrix source/sink interfaces.
+ *
+ * Every backend (Cube/TPP, OMX, native raw) exposes the same row view:
+ * tables and rows are numbered from 1, and a row buffer holds getZones()
+ * doubles starting at rowptr[0].  The conversion loop in copy_data() only
+ * talks to these interfaces, so it can run against any pair of backends.
+ */
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef MATRIXIO_H
+#define MATRIXIO_H
+
+// A sink's ready-to-write form of a row block, e.g. compressed chunks
+struct EncodedRows {
+    int      firstRow;
+    int      nRows;
+    vector< vector<unsigned char> > buf;
+    vector<unsigned long> len;
+    vector<unsigned char> zero;     // 1 = all-zero chunk: nothing to write
+};
+
+class MatrixSource {
+public:
+    virtual          ~MatrixSource() {}
+
+    virtual int      getZones() = 0;
+    virtual int      getTables() = 0;
+    // Values per row: only an OMX origin/destination window differs
+    virtual int      getCols() { return getZones(); }
+    virtual string   getTableName(int table) = 0;
+    virtual void     getRow(int table, int row, double *rowptr) = 0;
+    virtual void     closeFile() = 0;
+
+    // Read nRows consecutive rows, packed getZones() apart in data.
+    // Backends with per-call overhead override this.
+    virtual void     getRows(int table, int firstRow, int nRows, double *data) {
+        for (int r=0; r<nRows; r++) {
+            getRow(table, firstRow+r, data + (size_t)r*getZones());
+        }
+    }
+
+    // Preferred number of rows per getRows() call
+    virtual int      getReadBlockRows() { return 1; }
+
+    // Unit of random access for CellCache: reading one cell costs as much
+    // as reading the whole tile.  Rows by default.
+    virtual void     getTileShape(int table, int &rows, int &cols) {
+        rows = 1;
+        cols = getCols();
+    }
+
+    // Read nRows x nCols cells from (firstRow, firstCol), packed nCols apart
+    virtual void     getTile(int table, int firstRow, int nRows, int firstCol, int nCols, double *data) {
+        vector<double> row(getCols()+3);
+        for (int r=0; r<nRows; r++) {
+            getRow(table, firstRow+r, &row[0]);
+            for (int c=0; c<nCols; c++) data[(size_t)r*nCols + c] = row[firstCol-1 + c];
+        }
+    }
+
+    // HDF5 is not thread-safe: at most one HDF5 backend per thread
+    virtual bool     usesHDF5() { return false; }
+
+    // Row buffer with a little slack, since some backends write past nZones
+    virtual double*  allocateRowBuffer() {
+        return (double *) malloc((getZones()+3) * sizeof(double));
+    }
+};
+
+class MatrixSink {
+public:
+    virtual          ~MatrixSink() {}
+
+    virtual void     writeRow(int table, int row, double *rowptr) = 0;
+    virtual void     closeFile() = 0;
+
+    // Write nRows consecutive rows, packed nZones apart in data.
+    // Backends with per-call overhead override this.
+    virtual void     writeRows(int table, int firstRow, int nRows, double *data) {
+        for (int r=0; r<nRows; r++) {
+            writeRow(table, firstRow+r, data + (size_t)r*getZones());
+        }
+    }
+
+    // Preferred number of rows per writeRows() call
+    virtual int      getBlockRows() { return 1; }
+    virtual int      getZones() = 0;
+    virtual bool     usesHDF5() { return false; }
+
+    // Optional encode stage, split from writing so the two can overlap.
+    // encodeRows() may run on another thread than writeEncoded(), and
+    // returns false if the block has to go through writeRows() instead.
+    virtual bool     canEncode() { return false; }
+    virtual bool     encodeRows(int table, int firstRow, int nRows, double *data, EncodedRows &out) {
+        return false;
+    }
+    virtual void     writeEncoded(int table, EncodedRows &enc) { }
+};
+
+#endif /* MATRIXIO_H */
@@ -0,0 +1,315 @@
+/* memmatrix.cpp
+ *
+ * Native in-memory / raw-file matrix backend.
+ *
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "memmatrix.h"
+
+using namespace std;
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+#define  MEM_NONE    0
+#define  MEM_MEMORY  1
+#define  MEM_READ    2
+#define  MEM_CREATE  3
+
+// ###########################################################################
+// MemMatrix:  matrix tables held in memory or in a raw zone-major file
+// ---------------------------------------------------------------------------
+
+MemMatrix::MemMatrix() {
+    _fileOpen = false;
+    _stream = false;
+    _nTables = 0;
+    _nZones = 0;
+    _mode = MEM_NONE;
+    _file = NULL;
+    _dataStart = 0;
+    _filePos = 0;
+}
+
+//Destructor
+MemMatrix::~MemMatrix()
+{
+    closeFile();
+}
+
+void MemMatrix::create(int tables, int zones, vector<string> &tableNames) {
+    if (_fileOpen == true)
+        throw InvalidOperationException();
+
+    _mode = MEM_MEMORY;
+    _nTables = tables;
+    _nZones = zones;
+    _tableName = tableNames;
+    _data.assign((size_t)tables * zones * zones, 0.0);
+    _fileOpen = true;
+}
+
+//Raw file operations -------------------------------------------------------
+
+bool MemMatrix::isRawFile(const char *fileName) {
+    char magic[RAW_MAGIC_LEN];
+
+    FILE *f = fopen(fileName, "rb");
+    if (f == NULL) return false;
+
+    size_t n = fread(magic, 1, RAW_MAGIC_LEN, f);
+    fclose(f);
+
+    return (n == RAW_MAGIC_LEN && memcmp(magic, RAW_MAGIC, RAW_MAGIC_LEN) == 0);
+}
+
+void MemMatrix::openFile(string fileName) {
+    if (_fileOpen == true)
+        throw InvalidOperationException();
+
+    _file = fopen(fileName.c_str(), "rb");
+    if (_file == NULL) {
+        fprintf(stderr, "ERROR: Can't find or open file %s\n", fileName.c_str());
+        throw FileOpenException();
+    }
+
+    _mode = MEM_READ;
+    _fileOpen = true;
+    readHeader(fileName);
+}
+
+void MemMatrix::createFile(int tables, int zones, vector<string> &tableNames, string fileName) {
+    if (_fileOpen == true)
+        throw InvalidOperationException();
+
+    _file = fopen(fileName.c_str(), "wb");
+    if (_file == NULL) {
+        fprintf(stderr, "ERROR: Could not create file %s.\n", fileName.c_str());
+        throw FileOpenException();
+    }
+
+    _mode = MEM_CREATE;
+    _fileOpen = true;
+    _nTables = tables;
+    _nZones = zones;
+    _tableName = tableNames;
+
+    writeHeader();
+}
+
+void MemMatrix::openStream(FILE *stream, string name) {
+    if (_fileOpen == true)
+        throw InvalidOperationException();
+
+    _file = stream;
+    _stream = true;
+    _mode = MEM_READ;
+    _fileOpen = true;
+    readHeader(name);
+}
+
+void MemMatrix::createStream(int tables, int zones, vector<string> &tableNames, FILE *stream) {
+    if (_fileOpen == true)
+        throw InvalidOperationException();
+
+    _file = stream;
+    _stream = true;
+    _mode = MEM_CREATE;
+    _fileOpen = true;
+    _nTables = tables;
+    _nZones = zones;
+    _tableName = tableNames;
+
+    writeHeader();
+}
+
+void MemMatrix::closeFile() {
+    if (_file != NULL && _stream) {
+        if (_mode == MEM_CREATE && 0 != fflush(_file)) {
+            fprintf(stderr, "ERROR: writing raw stream\n");
+            exit(2);
+        }
+        _file = NULL;
+    }
+    if (_file != NULL) {
+        fclose(_file);
+        _file = NULL;
+    }
+    _stream = false;
+    _data.clear();
+    _fileOpen = false;
+    _mode = MEM_NONE;
+}
+
+int MemMatrix::getZones() {
+    return _nZones;
+}
+
+int MemMatrix::getTables() {
+    return _nTables;
+}
+
+string MemMatrix::getTableName(int table) {
+    if (table < 1 || table > _nTables) return "";
+    return _tableName[table-1];
+}
+
+void MemMatrix::getRow(int table, int row, double *rowptr) {
+    if (table < 1 || table > _nTables || row < 1 || row > _nZones) {
+        fprintf(stderr, "ERROR: No such row: table %d, row %d\n", table, row);
+        throw MatrixReadException();
+    }
+
+    if (_mode == MEM_MEMORY) {
+        memcpy(rowptr, &_data[((size_t)(row-1)*_nTables + (table-1)) * _nZones],
+               _nZones * sizeof(double));
+        return;
+    }
+
+    if (_mode != MEM_READ)
+        throw InvalidOperationException();
+
+    seekTo(rowOffset(table, row));
+    if (fread(rowptr, sizeof(double), _nZones, _file) != (size_t)_nZones) {
+        fprintf(stderr, "ERROR: Couldn't read table %d, row %d.\n", table, row);
+        throw MatrixReadException();
+    }
+    _filePos += (long long)_nZones * sizeof(double);
+}
+
+/*
+ * Rows can be written in any order, but writing them zone-major
+ * (for rows, for tables) keeps raw file output strictly sequential.
+ */
+void MemMatrix::writeRow(int table, int row, double *rowptr) {
+    if (table < 1 || table > _nTables || row < 1 || row > _nZones) {
+        fprintf(stderr, "ERROR: writing table %d, row %d\n", table, row);
+        exit(2);
+    }
+
+    if (_mode == MEM_MEMORY) {
+        memcpy(&_data[((size_t)(row-1)*_nTables + (table-1)) * _nZones], rowptr,
+               _nZones * sizeof(double));
+        return;
+    }
+
+    if (_mode != MEM_CREATE)
+        throw InvalidOperationException();
+
+    seekTo(rowOffset(table, row));
+    if (fwrite(rowptr, sizeof(double), _nZones, _file) != (size_t)_nZones) {
+        fprintf(stderr, "ERROR: writing table %d, row %d\n", table, row);
+        exit(2);
+    }
+    _filePos += (long long)_nZones * sizeof(double);
+}
+
+// ---- Private functions ---------------------------------------------------
+
+long long MemMatrix::rowOffset(int table, int row) {
+    return _dataStart + ((long long)(row-1)*_nTables + (table-1)) * _nZones * sizeof(double);
+}
+
+// Only seek when we have to, so sequential access never needs a seekable file
+void MemMatrix::seekTo(long long offset) {
+    if (offset == _filePos) return;
+
+    // Pipes can't seek: skip forward by reading, never back
+    if (_stream) {
+        char skip[65536];
+        if (offset < _filePos || _mode != MEM_READ) {
+            fprintf(stderr, "ERROR: Raw streams must be read and written in zone-major order\n");
+            throw InvalidOperationException();
+        }
+        while (_filePos < offset) {
+            size_t n = (size_t)min((long long)sizeof(skip), offset - _filePos);
+            if (fread(skip, 1, n, _file) != n) {
+                fprintf(stderr, "ERROR: Raw stream ended early\n");
+                throw MatrixReadException();
+            }
+            _filePos += n;
+        }
+        return;
+    }
+
+    if (0 != fseek64(_file, offset, SEEK_SET)) {
+        fprintf(stderr, "ERROR: Couldn't position raw file at %lld\n", offset);
+        throw InvalidOperationException();
+    }
+    _filePos = offset;
+}
+
+void MemMatrix::writeHeader() {
+    int header[3];
+    string names;
+
+    for (int t=0; t<_nTables; t++) {
+        names += _tableName[t];
+        names.push_back('\0');
+    }
+
+    // Pad so the first row starts on an 8-byte boundary
+    int headerLength = RAW_MAGIC_LEN + sizeof(header) + names.size();
+    headerLength = (headerLength + 7) & ~7;
+    names.resize(headerLength - RAW_MAGIC_LEN - sizeof(header), '\0');
+
+    header[0] = _nZones;
+    header[1] = _nTables;
+    header[2] = headerLength;
+
+    fwrite(RAW_MAGIC, 1, RAW_MAGIC_LEN, _file);
+    fwrite(header, sizeof(int), 3, _file);
+    if (fwrite(names.data(), 1, names.size(), _file) != names.size()) {
+        fprintf(stderr, "ERROR: Couldn't write raw file header\n");
+        exit(2);
+    }
+
+    _dataStart = headerLength;
+    _filePos = headerLength;
+}
+
+void MemMatrix::readHeader(string fileName) {
+    char magic[RAW_MAGIC_LEN];
+    int header[3];
+
+    if (fread(magic, 1, RAW_MAGIC_LEN, _file) != RAW_MAGIC_LEN ||
+        memcmp(magic, RAW_MAGIC, RAW_MAGIC_LEN) != 0 ||
+        fread(header, sizeof(int), 3, _file) != 3) {
+        fprintf(stderr, "ERROR: %s is not a raw matrix file\n", fileName.c_str());
+        throw FileOpenException();
+    }
+
+    _nZones = header[0];
+    _nTables = header[1];
+    _dataStart = header[2];
+
+    int namesLength = _dataStart - RAW_MAGIC_LEN - sizeof(header);
+    if (_nZones < 1 || _nTables < 1 || namesLength < 0) {
+        fprintf(stderr, "ERROR: %s has a corrupt raw file header\n", fileName.c_str());
+        throw FileOpenException();
+    }
+
+    vector<char> names(namesLength + 1, '\0');
+    if (fread(&names[0], 1, namesLength, _file) != (size_t)namesLength) {
+        fprintf(stderr, "ERROR: %s has a corrupt raw file header\n", fileName.c_str());
+        throw FileOpenException();
+    }
+
+    const char *c = &names[0];
+    _tableName.clear();
+    const char *end = &names[namesLength];
+    for (int t=0; t<_nTables; t++) {
+        _tableName.push_back(string(c));
+        c += strlen(c) + 1;
+        if (c > end) c = end;
+    }
+
+    _filePos = _dataStart;
+}
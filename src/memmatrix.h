@@ -0,0 +1,88 @@
+/* memmatrix.h
+ *
+ * Native matrix backend: holds matrices in memory, or in a simple raw file.
+ * Needs no Citilabs DLL, so the conversion loop can run on any platform.
+ *
+ * Raw file layout (native byte order, i.e. little-endian on x86):
+ *
+ *   char[8]   magic "MTXRAW01"
+ *   int32     zones
+ *   int32     tables
+ *   int32     header length in bytes (= file offset of the first row)
+ *   char[]    table names, each NUL-terminated, NUL-padded to header length
+ *   double[]  rows in zone-major order: for each origin 1..zones,
+ *             for each table 1..tables, one row of <zones> doubles
+ *
+ * The same layout doubles as a stream format for pipes (stdin/stdout).
+ * Streams can't seek, so they are read and written strictly in order;
+ * a reader may skip forward, never back.
+ */
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "matrixio.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef MEMMATRIX_H
+#define MEMMATRIX_H
+
+#define RAW_MAGIC      "MTXRAW01"
+#define RAW_MAGIC_LEN  8
+
+class MemMatrix : public MatrixSource, public MatrixSink {
+public:
+    MemMatrix();
+    virtual  ~MemMatrix();
+
+    //In-memory matrix, readable and writable
+    void     create(int tables, int zones, vector<string> &tableNames);
+
+    //Raw file operations
+    void     openFile(string fileName);
+    void     createFile(int tables, int zones, vector<string> &tableNames, string fileName);
+    void     closeFile();
+
+    //Raw streams, e.g. stdin/stdout; the caller owns the FILE
+    void     openStream(FILE *stream, string name);
+    void     createStream(int tables, int zones, vector<string> &tableNames, FILE *stream);
+
+    int      getZones();
+    int      getTables();
+    string   getTableName(int table);
+    void     getRow(int table, int row, double *rowptr);
+    void     writeRow(int table, int row, double *rowptr);
+
+    static bool isRawFile(const char *fileName);
+
+    //Nested exception classes
+    class    FileOpenException { };
+    class    MatrixReadException { };
+    class    InvalidOperationException { };
+
+//--------------------------------------------------------------------
+private:
+    //Data
+    int      _nZones;
+    int      _nTables;
+    int      _mode;
+    bool     _fileOpen;
+    bool     _stream;
+
+    vector<string> _tableName;
+    vector<double> _data;       // in-memory mode only
+
+    FILE*    _file;             // raw file mode only
+    long long _dataStart;
+    long long _filePos;
+
+    //Methods
+    long long rowOffset(int table, int row);
+    void     seekTo(long long offset);
+    void     writeHeader();
+    void     readHeader(string fileName);
+};
+
+#endif /* MEMMATRIX_H */
@@ -8,11 +8,89 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <cmath>
+#include <climits>
+
+#include <zlib.h>
 
 #include "omxmatrix.h"
 
 using namespace std;
 
+// ---- Storage type helpers ------------------------------------------------
+
+// Memory type matching the on-disk type, so HDF5 writes without converting
+static hid_t storageType(int type) {
+    switch (type) {
+        case STORE_FLOAT32: return H5T_NATIVE_FLOAT;
+        case STORE_INT32:
+        case STORE_SCALED:  return H5T_NATIVE_INT;
+        default:            return H5T_NATIVE_DOUBLE;
+    }
+}
+
+static size_t storageSize(int type) {
+    return (type == STORE_FLOAT64) ? sizeof(double) : 4;
+}
+
+// Convert n doubles to the storage type.  Integers are rounded to nearest
+// and clamped to the int32 range; NaN is stored as 0.  out may equal in.
+static void convertValues(const double *in, size_t n, const OMXStorage &s, void *out) {
+    if (s.type == STORE_FLOAT64) {
+        if (out != in) memcpy(out, in, n * sizeof(double));
+
+    } else if (s.type == STORE_FLOAT32) {
+        float *f = (float *) out;
+        for (size_t i=0; i<n; i++) f[i] = (float) in[i];
+
+    } else {
+        double scale = (s.type == STORE_SCALED) ? s.scale : 1.0;
+        int *v = (int *) out;
+        for (size_t i=0; i<n; i++) {
+            double x = floor(in[i] * scale + 0.5);
+            if (x != x) x = 0;
+            else if (x > INT_MAX) x = INT_MAX;
+            else if (x < INT_MIN) x = INT_MIN;
+            v[i] = (int) x;
+        }
+    }
+}
+
+// Table name match with * and ? wildcards
+static bool globMatch(const char *pattern, const char *name) {
+    if (*pattern == '\0') return *name == '\0';
+    if (*pattern == '*') {
+        for (const char *c = name; ; c++) {
+            if (globMatch(pattern+1, c)) return true;
+            if (*c == '\0') return false;
+        }
+    }
+    if (*name == '\0') return false;
+    if (*pattern == '?' || *pattern == *name) return globMatch(pattern+1, name+1);
+    return false;
+}
+
+static size_t nextPrime(size_t n) {
+    if (n < 3) return 2;
+    for (n |= 1; ; n += 2) {
+        bool prime = true;
+        for (size_t d=3; d*d<=n; d+=2) {
+            if (n % d == 0) { prime = false; break; }
+        }
+        if (prime) return n;
+    }
+}
+
+static long long lcm(long long a, long long b) {
+    long long x = a, y = b;
+    while (y != 0) {
+        long long r = x % y;
+        x = y;
+        y = r;
+    }
+    return a / x * b;
+}
+
 // ###########################################################################
 // OMXMatrix:  C++ Helper class to read/write TP+ style matrix tables
 // ---------------------------------------------------------------------------
@@ -23,6 +101,13 @@ OMXMatrix::OMXMatrix() {
     _nRows = 0;
     _nCols = 0;
     _memspace = -1;
+    _blockspace = -1;
+    _blockspaceRows = 0;
+    _chunkRows = 1;
+    _chunkCols = 0;
+    _pool = NULL;
+    _cells = NULL;
+    _zeroChunks = 0;
 }
 
 //Destructor
@@ -33,6 +118,16 @@ OMXMatrix::~OMXMatrix()
         _memspace = -1;
     }
 
+    if (_blockspace > -1 ) {
+        H5Sclose(_blockspace);
+        _blockspace = -1;
+    }
+
+    delete _pool;
+    _pool = NULL;
+    delete _cells;
+    _cells = NULL;
+
     // Close H5 file handles
     if (_fileOpen==true) {
         H5Fclose(_h5file);
@@ -43,6 +138,14 @@ OMXMatrix::~OMXMatrix()
 
 //Write/Create operations ---------------------------------------------------
 
+void OMXMatrix::setWriteOptions(OMXWriteOptions &options) {
+    _options = options;
+}
+
+void OMXMatrix::setCacheOptions(OMXCacheOptions &options) {
+    _cache = options;
+}
+
 void OMXMatrix::createFile(int tables, int rows, int cols, vector<string> &tableNames, string fileName) {
     _fileOpen = true;
     _mode = MODE_CREATE;
@@ -52,7 +155,9 @@ void OMXMatrix::createFile(int tables, int rows, int cols, vector<string> &table
     _nTables = tables;
 
     // Create the physical file
-    _h5file = H5Fcreate(fileName.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    hid_t fapl = create_fapl();
+    _h5file = H5Fcreate(fileName.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    H5Pclose(fapl);
     if (0 > _h5file) {
         fprintf(stderr, "ERROR: Could not create file %s.\n", fileName.c_str());
     }
@@ -69,18 +174,242 @@ void OMXMatrix::createFile(int tables, int rows, int cols, vector<string> &table
     H5Pset_link_creation_order(plist, H5P_CRT_ORDER_TRACKED);
    
     // Create folder structure
-    H5Gcreate(_h5file, "/data", NULL, plist, NULL);
-    H5Gcreate(_h5file, "/lookup", NULL, plist, NULL);
+    H5Gclose(H5Gcreate(_h5file, "/data", NULL, plist, NULL));
+    H5Gclose(H5Gcreate(_h5file, "/lookup", NULL, plist, NULL));
     
     H5Pclose(plist);
     
     // Create the datasets
     init_tables(tableNames);
+    create_pool();
+}
+
+/*
+ * Open an existing file to rewrite some of its tables.  The tables in
+ * replaced are deleted and created again with the current write options,
+ * as table numbers 1.. in that order, with the given CUBE_MAT_NUMBERs.
+ * Tables in removed are deleted.  The values of all others are left
+ * untouched.  order lists every table of the updated file by
+ * CUBE_MAT_NUMBER, which /data is relinked to follow.
+ */
+void OMXMatrix::updateFile(vector<string> &order, vector<string> &replaced, vector<int> &cubeNumbers,
+                           vector<string> &removed, string fileName) {
+    hid_t fapl = create_fapl();
+    _h5file = H5Fopen(fileName.c_str(), H5F_ACC_RDWR, fapl);
+    H5Pclose(fapl);
+    if (_h5file < 0) {
+        fprintf(stderr, "ERROR: Can't open %s for update\n", fileName.c_str());
+        exit(2);
+    }
+    _fileOpen = true;
+    _mode = MODE_CREATE;
+
+    int shape[2];
+    if (0 > H5LTget_attribute_int(_h5file, "/", "SHAPE", &shape[0])) {
+        fprintf(stderr, "ERROR: %s doesn't have SHAPE attribute\n", fileName.c_str());
+        exit(2);
+    }
+    _nRows = shape[0];
+    _nCols = shape[1];
+    _nTables = replaced.size();
+
+    // Checked before anything changes, so the file is never left half updated
+    if (H5Lexists(_h5file, REORDER_LINK, H5P_DEFAULT) > 0) {
+        fprintf(stderr, "ERROR: %s has a %s link; can't reorder its tables\n", fileName.c_str(), REORDER_LINK);
+        exit(2);
+    }
+
+    for (unsigned int t=0; t<replaced.size(); t++) deleteTable(replaced[t]);
+    for (unsigned int t=0; t<removed.size(); t++) deleteTable(removed[t]);
+
+    init_tables(replaced);
+    for (unsigned int t=0; t<replaced.size(); t++) {
+        string tpath = "/data/" + replaced[t];
+        H5LTset_attribute_int(_h5file, tpath.c_str(), CUBE_MAT_NUMBER, &cubeNumbers[t], 1);
+    }
+    orderTables(order);
+    create_pool();
+}
+
+/*
+ * Readers number tables in /data's link creation order, and recreated
+ * tables come last.  Moving every link out and back puts them in order
+ * again; the tables themselves stay where they are.
+ */
+void OMXMatrix::orderTables(vector<string> &order) {
+    for (unsigned int t=0; t<order.size(); t++) {
+        string path = "/data/" + order[t];
+
+        if (0 > H5Lmove(_h5file, path.c_str(), _h5file, REORDER_LINK, H5P_DEFAULT, H5P_DEFAULT) ||
+            0 > H5Lmove(_h5file, REORDER_LINK, _h5file, path.c_str(), H5P_DEFAULT, H5P_DEFAULT)) {
+            fprintf(stderr, "ERROR: reordering table %s\n", order[t].c_str());
+            exit(2);
+        }
+    }
+}
+
+// Compress chunks on our own threads, then hand them to HDF5 ready-made
+void OMXMatrix::create_pool() {
+    int threads = _options.threads;
+    if (threads < 1) threads = ThreadPool::defaultThreads();
+    if (threads > 1 && _options.deflate > 0) {
+        _pool = new ThreadPool(threads);
+    }
+}
+
+// Unlink a table and its row and column sums, if they exist
+void OMXMatrix::deleteTable(string table) {
+    string paths[3] = { "/data/" + table,
+                        string(STATS_GROUP) + "/row_sums/" + table,
+                        string(STATS_GROUP) + "/col_sums/" + table };
+
+    for (int i=0; i<3; i++) {
+        string parent = paths[i].substr(0, paths[i].rfind('/'));
+        if (H5Lexists(_h5file, parent.c_str(), H5P_DEFAULT) <= 0) continue;
+        if (H5Lexists(_h5file, paths[i].c_str(), H5P_DEFAULT) <= 0) continue;
+
+        if (0 > H5Ldelete(_h5file, paths[i].c_str(), H5P_DEFAULT)) {
+            fprintf(stderr, "ERROR: deleting %s\n", paths[i].c_str());
+            exit(2);
+        }
+    }
+}
+
+/*
+ * Zone numbers for the rows and/or columns, as /lookup/<name>.  dim is
+ * "row" or "col" when the lookup only fits one side, or NULL.
+ */
+void OMXMatrix::writeLookup(string name, vector<int> &zones, const char *dim) {
+    string path = "/lookup/" + name;
+    hsize_t dims[1] = { zones.size() };
+
+    // Replaced by an update
+    if (H5Lexists(_h5file, path.c_str(), H5P_DEFAULT) > 0) {
+        H5Ldelete(_h5file, path.c_str(), H5P_DEFAULT);
+    }
+
+    if (0 > H5LTmake_dataset_int(_h5file, path.c_str(), 1, dims, &zones[0])) {
+        fprintf(stderr, "ERROR: writing lookup %s\n", name.c_str());
+        exit(2);
+    }
+    if (dim != NULL) {
+        H5LTset_attribute_string(_h5file, path.c_str(), "dim", dim);
+    }
+}
+
+/*
+ * Summary statistics as attributes of the table's dataset, with the row
+ * and column sums in /stats/row_sums/<table> and /stats/col_sums/<table>.
+ * Min and max are NaN for a table with no finite values.
+ */
+void OMXMatrix::writeStats(int table, TableStats &stats) {
+    string name = getTableName(table);
+    string path = "/data/" + name;
+    ValueStats &v = stats.values;
+
+    double lo = v.min <= v.max ? v.min : NAN;
+    double hi = v.min <= v.max ? v.max : NAN;
+
+    H5LTset_attribute_double(_h5file, path.c_str(), STAT_TOTAL, &v.sum, 1);
+    H5LTset_attribute_double(_h5file, path.c_str(), STAT_MIN, &lo, 1);
+    H5LTset_attribute_double(_h5file, path.c_str(), STAT_MAX, &hi, 1);
+    H5LTset_attribute_long_long(_h5file, path.c_str(), STAT_NONZERO, &v.nonzero, 1);
+    H5LTset_attribute_long_long(_h5file, path.c_str(), STAT_NAN, &v.nans, 1);
+    H5LTset_attribute_long_long(_h5file, path.c_str(), STAT_INF, &v.infs, 1);
+
+    if (H5Lexists(_h5file, STATS_GROUP, H5P_DEFAULT) <= 0) {
+        hid_t g = H5Gcreate2(_h5file, STATS_GROUP, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        H5Gclose(H5Gcreate2(g, "row_sums", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+        H5Gclose(H5Gcreate2(g, "col_sums", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+        H5Gclose(g);
+    }
+
+    hsize_t rows[1] = { stats.rowSums.size() };
+    hsize_t cols[1] = { stats.colSums.size() };
+    string rowPath = string(STATS_GROUP) + "/row_sums/" + name;
+    string colPath = string(STATS_GROUP) + "/col_sums/" + name;
+
+    if (0 > H5LTmake_dataset_double(_h5file, rowPath.c_str(), 1, rows, &stats.rowSums[0]) ||
+        0 > H5LTmake_dataset_double(_h5file, colPath.c_str(), 1, cols, &stats.colSums[0])) {
+        fprintf(stderr, "ERROR: writing statistics for table %s\n", name.c_str());
+        exit(2);
+    }
+}
+
+// The hash goes with the write options, since the same values stored
+// another way are a different table
+void OMXMatrix::writeContentHash(int table, string hash) {
+    string name = getTableName(table);
+    string path = "/data/" + name;
+    H5LTset_attribute_string(_h5file, path.c_str(), CONTENT_HASH, hash.c_str());
+    H5LTset_attribute_string(_h5file, path.c_str(), WRITE_SETTINGS, describeWriteOptions(name).c_str());
+}
+
+// A table's CONTENT_HASH, or "" if it has none
+string OMXMatrix::getContentHash(string table) {
+    return getStringAttribute("/data/" + table, CONTENT_HASH);
+}
+
+// A table's WRITE_SETTINGS, or "" if it has none
+string OMXMatrix::getWriteSettings(string table) {
+    return getStringAttribute("/data/" + table, WRITE_SETTINGS);
+}
+
+/*
+ * The write options that decide how a new table called table is stored,
+ * as written to WRITE_SETTINGS: compare it with getWriteSettings() to see
+ * whether a table was written with the current options.  Uses the shape
+ * of the open file, for the chunk shape.
+ */
+string OMXMatrix::describeWriteOptions(string table) {
+    OMXStorage storage;
+    int digits;
+    bool sparse;
+    resolveTable(table, storage, digits, sparse, false);
+    choose_chunks();
+
+    char text[160];
+    if (sparse) {
+        sprintf(text, "storage %d scale %.17g sparse deflate %d shuffle %d", storage.type,
+                storage.scale, _options.deflate, _options.shuffle ? 1 : 0);
+    } else {
+        sprintf(text, "storage %d scale %.17g digits %d deflate %d shuffle %d chunks %dx%d",
+                storage.type, storage.scale, digits, _options.deflate, _options.shuffle ? 1 : 0,
+                _chunkRows, _chunkCols);
+    }
+    return text;
+}
+
+// A string attribute of the object at path, or "" if it has none
+string OMXMatrix::getStringAttribute(string path, const char *name) {
+    if (H5Aexists_by_name(_h5file, path.c_str(), name, H5P_DEFAULT) <= 0) return "";
+
+    hsize_t dims[1];
+    H5T_class_t type;
+    size_t size = 0;
+    char value[256] = "";
+    H5LTget_attribute_info(_h5file, path.c_str(), name, dims, &type, &size);
+    if (type == H5T_STRING && size < sizeof(value)) {
+        H5LTget_attribute_string(_h5file, path.c_str(), name, value);
+    }
+    return value;
+}
+
+// Renumber a table that is otherwise left as it is
+void OMXMatrix::setCubeNumber(string table, int number) {
+    string path = "/data/" + table;
+    H5LTset_attribute_int(_h5file, path.c_str(), CUBE_MAT_NUMBER, &number, 1);
 }
 
 void OMXMatrix::writeRow(string table, int row, double *rowdata) {
-    if (_tableLookup.count(table)==0) {
-            throw NoSuchTableException();
+    writeRow(tableNumber(table), row, rowdata);
+}
+
+void OMXMatrix::writeRow(int table, int row, double *rowdata) {
+    OMXTable &tb = handle(table);
+    if (tb.sparse) {
+        appendSparse(table, row, rowdata);
+        return;
     }
 
     hsize_t count[2], offset[2];
@@ -93,23 +422,378 @@ void OMXMatrix::writeRow(string table, int row, double *rowdata) {
 
     if (_memspace <0 ) _memspace = H5Screate_simple(2,count,NULL);
 
-    if (_dataspace.count(table)==0) {
-        _dataspace[table] = H5Dget_space(_dataset[table]);
+    H5Sselect_hyperslab (tb.dataspace, H5S_SELECT_SET, offset, NULL, count, NULL);
+
+    hid_t memtype;
+    void *buf = toStorage(table, rowdata, _nCols, memtype);
+    trackScaleOffsetError(table, row, 1, rowdata);
+
+    if (writeNonzeroChunks(table, row, 1, _memspace, memtype, buf, rowdata)) return;
+
+    if (0 > H5Dwrite(tb.dataset, memtype, _memspace, tb.dataspace, H5P_DEFAULT, buf)) {
+        fprintf(stderr, "ERROR: writing table %s, row %d\n", tb.name.c_str(), row);
+        exit(2);
     }
+}
+
+/*
+ * Write nRows consecutive rows with a single H5Dwrite.  Rows are packed
+ * nCols apart in data.  Blocks that start and end on chunk boundaries
+ * (see getBlockRows) never leave a chunk half-written.
+ */
+void OMXMatrix::writeRows(string table, int firstRow, int nRows, double *data) {
+    writeRows(tableNumber(table), firstRow, nRows, data);
+}
+
+void OMXMatrix::writeRows(int table, int firstRow, int nRows, double *data) {
+    OMXTable &tb = handle(table);
+    if (tb.sparse) {
+        for (int r=0; r<nRows; r++) appendSparse(table, firstRow+r, data + (size_t)r*_nCols);
+        return;
+    }
+
+    if (encodeRows(table, firstRow, nRows, data, _encoded)) {
+        writeEncoded(table, _encoded);
+        return;
+    }
+
+    hsize_t count[2], offset[2];
+
+    count[0] = nRows;
+    count[1] = _nCols;
+
+    offset[0] = firstRow-1;
+    offset[1] = 0;
+
+    // Keep one memory dataspace around; blocks are nearly always the same size
+    if (_blockspace < 0 || _blockspaceRows != nRows) {
+        if (_blockspace > -1) H5Sclose(_blockspace);
+        _blockspace = H5Screate_simple(2,count,NULL);
+        _blockspaceRows = nRows;
+    }
+
+    H5Sselect_hyperslab (tb.dataspace, H5S_SELECT_SET, offset, NULL, count, NULL);
 
-    H5Sselect_hyperslab (_dataspace[table], H5S_SELECT_SET, offset, NULL, count, NULL);
+    hid_t memtype;
+    void *buf = toStorage(table, data, (size_t)nRows * _nCols, memtype);
+    trackScaleOffsetError(table, firstRow, nRows, data);
 
-    if (0 > H5Dwrite(_dataset[table], H5T_NATIVE_DOUBLE, _memspace, _dataspace[table], H5P_DEFAULT, rowdata)) {
-        fprintf(stderr, "ERROR: writing table %s, row %d\n", table.c_str(), row);
+    if (writeNonzeroChunks(table, firstRow, nRows, _blockspace, memtype, buf, data)) return;
+
+    if (0 > H5Dwrite(tb.dataset, memtype, _blockspace, tb.dataspace, H5P_DEFAULT, buf)) {
+        fprintf(stderr, "ERROR: writing table %s, rows %d-%d\n", tb.name.c_str(), firstRow, firstRow+nRows-1);
         exit(2);
     }
 }
 
+/*
+ * Write only the parts of a row block that fall in chunks with a nonzero
+ * value, so HDF5 never allocates the all-zero chunks; they read back as
+ * the 0.0 fill value.  Returns false, having written nothing, if there are
+ * no all-zero chunks, since one H5Dwrite of the whole block is cheaper.
+ * buf holds the block in the storage type, data the same values as doubles.
+ */
+bool OMXMatrix::writeNonzeroChunks(int table, int firstRow, int nRows, hid_t memspace,
+                                   hid_t memtype, void *buf, double *data) {
+    struct Piece { int row, nRows, tile; };
+    vector<Piece> pieces;
+
+    OMXTable &tb = handle(table);
+    int tiles = (_nCols + _chunkCols - 1) / _chunkCols;
+    vector<int> last(tiles, -1);
+    int zero = 0;
+
+    // Walk the chunk grid over the block; a tile's consecutive nonzero
+    // chunks merge into one piece.  A chunk counts as skipped once its
+    // last row is written, if no part of it had a nonzero value.
+    for (int r=0; r<nRows; ) {
+        int row0 = firstRow-1 + r;
+        int n = min(_chunkRows - row0 % _chunkRows, nRows - r);
+        bool bandEnds = (row0 + n) % _chunkRows == 0 || row0 + n == _nRows;
+        if (row0 % _chunkRows == 0 || (int)tb.bandNonzero.size() != tiles) tb.bandNonzero.assign(tiles, 0);
+
+        for (int tile=0; tile<tiles; tile++) {
+            int col0 = tile * _chunkCols;
+            int cols = min(_chunkCols, _nCols - col0);
+
+            bool allzero = true;
+            for (int i=0; allzero && i<n; i++) {
+                allzero = allZero(data + (size_t)(r+i)*_nCols + col0, cols);
+            }
+            if (!allzero) tb.bandNonzero[tile] = 1;
+            if (bandEnds && !tb.bandNonzero[tile]) _zeroChunks++;
+
+            if (allzero) {
+                zero++;
+            } else if (last[tile] >= 0 && pieces[last[tile]].row + pieces[last[tile]].nRows == r) {
+                pieces[last[tile]].nRows += n;
+            } else {
+                Piece p = { r, n, tile };
+                last[tile] = pieces.size();
+                pieces.push_back(p);
+            }
+        }
+        r += n;
+    }
+
+    if (zero == 0) return false;
+
+    for (unsigned int i=0; i<pieces.size(); i++) {
+        hsize_t count[2], memOffset[2], fileOffset[2];
+        count[0] = pieces[i].nRows;
+        count[1] = min(_chunkCols, _nCols - pieces[i].tile * _chunkCols);
+        memOffset[0] = pieces[i].row;
+        memOffset[1] = pieces[i].tile * _chunkCols;
+        fileOffset[0] = firstRow-1 + pieces[i].row;
+        fileOffset[1] = memOffset[1];
+
+        H5Sselect_hyperslab(memspace, H5S_SELECT_SET, memOffset, NULL, count, NULL);
+        H5Sselect_hyperslab(tb.dataspace, H5S_SELECT_SET, fileOffset, NULL, count, NULL);
+
+        if (0 > H5Dwrite(tb.dataset, memtype, memspace, tb.dataspace, H5P_DEFAULT, buf)) {
+            fprintf(stderr, "ERROR: writing table %s, rows %d-%d\n", tb.name.c_str(),
+                    (int)fileOffset[0]+1, (int)(fileOffset[0]+count[0]));
+            exit(2);
+        }
+    }
+    H5Sselect_all(memspace);
+    return true;
+}
+
+// Direct chunk writes need whole chunk bands: the block must start on a
+// chunk boundary and end on one, or at the end of the table.
+bool OMXMatrix::canWriteDirect(int firstRow, int nRows) {
+    if (_pool == NULL) return false;
+    if ((firstRow-1) % _chunkRows != 0) return false;
+    return (nRows % _chunkRows == 0 || firstRow-1+nRows == _nRows);
+}
+
+// Values ready for H5Dwrite in the table's storage type; sets the memory type
+void* OMXMatrix::toStorage(int table, double *data, size_t n, hid_t &memtype) {
+    const OMXStorage &storage = _storage[table];
+
+    memtype = storageType(storage.type);
+    if (storage.type == STORE_FLOAT64) return data;
+
+    _convertBuf.resize(n * storageSize(storage.type));
+    convertValues(data, n, storage, &_convertBuf[0]);
+    return &_convertBuf[0];
+}
+
+bool OMXMatrix::canEncode() {
+    return _pool != NULL;
+}
+
+bool OMXMatrix::usesHDF5() {
+    return true;
+}
+
+/*
+ * Deflate every chunk in the block on the thread pool, exactly as the HDF5
+ * shuffle+deflate filters would.  Edge chunks are padded with the 0.0 fill
+ * value.  Makes no HDF5 calls, so it can overlap with writeEncoded().
+ */
+bool OMXMatrix::encodeRows(int table, int firstRow, int nRows, double *data, EncodedRows &out) {
+    if (!canWriteDirect(firstRow, nRows)) return false;
+    if (_tables[table].sparse) return false;
+
+    // We can't reproduce the scale-offset filter; HDF5 has to run it
+    if (_digits[table] >= 0) return false;
+
+    int bands = (nRows + _chunkRows - 1) / _chunkRows;
+    int tiles = (_nCols + _chunkCols - 1) / _chunkCols;
+    int nChunks = bands * tiles;
+
+    const OMXStorage &storage = _storage[table];
+    size_t elemSize = storageSize(storage.type);
+    size_t chunkElems = (size_t)_chunkRows * _chunkCols;
+    size_t chunkBytes = chunkElems * elemSize;
+
+    out.firstRow = firstRow;
+    out.nRows = nRows;
+    if ((int)out.buf.size() < nChunks) out.buf.resize(nChunks);
+    out.len.assign(nChunks, 0);
+    out.zero.assign(nChunks, 0);
+
+    _pool->run(nChunks, [&](int c) {
+        int band = c / tiles;
+        int tile = c % tiles;
+        int col0 = tile * _chunkCols;
+        int cols = min(_chunkCols, _nCols - col0);
+
+        // All-zero chunks are never written, and read back as the 0.0
+        // fill value
+        bool zero = true;
+        for (int r=0; zero && r<_chunkRows; r++) {
+            int row = band*_chunkRows + r;
+            if (row >= nRows) break;
+            zero = allZero(data + (size_t)row*_nCols + col0, cols);
+        }
+        if (zero) {
+            out.zero[c] = 1;
+            return;
+        }
+
+        // Gather the chunk out of the row block
+        vector<double> chunk(chunkElems, 0.0);
+        for (int r=0; r<_chunkRows; r++) {
+            int row = band*_chunkRows + r;
+            if (row >= nRows) break;
+            memcpy(&chunk[(size_t)r*_chunkCols], data + (size_t)row*_nCols + col0, cols*sizeof(double));
+        }
+
+        // Convert in place to the on-disk type (never wider than double)
+        convertValues(&chunk[0], chunkElems, storage, &chunk[0]);
+        const unsigned char *src = (const unsigned char *) &chunk[0];
+
+        // Same byte order as H5Z_FILTER_SHUFFLE: all first bytes, then all second bytes...
+        vector<unsigned char> shuffled;
+        if (_options.shuffle) {
+            shuffled.resize(chunkBytes);
+            for (size_t i=0; i<chunkElems; i++) {
+                for (size_t b=0; b<elemSize; b++) {
+                    shuffled[b*chunkElems + i] = src[i*elemSize + b];
+                }
+            }
+            src = &shuffled[0];
+        }
+
+        uLongf len = compressBound(chunkBytes);
+        out.buf[c].resize(len);
+        if (Z_OK != compress2(&out.buf[c][0], &len, src, chunkBytes, _options.deflate)) {
+            len = 0;
+        }
+        out.len[c] = len;
+    });
+
+    return true;
+}
+
+/*
+ * Commit chunks from encodeRows() with H5Dwrite_chunk.  The result is a
+ * standard deflated dataset that any HDF5 reader can open.
+ */
+void OMXMatrix::writeEncoded(int table, EncodedRows &enc) {
+    OMXTable &tb = handle(table);
+
+    int tiles = (_nCols + _chunkCols - 1) / _chunkCols;
+    int nChunks = ((enc.nRows + _chunkRows - 1) / _chunkRows) * tiles;
+
+    for (int c=0; c<nChunks; c++) {
+        hsize_t offset[2];
+        offset[0] = enc.firstRow-1 + (c / tiles) * _chunkRows;
+        offset[1] = (c % tiles) * _chunkCols;
+
+        if (enc.zero[c]) {
+            _zeroChunks++;
+            continue;
+        }
+        if (enc.len[c] == 0) {
+            fprintf(stderr, "ERROR: compressing table %s, row %d\n", tb.name.c_str(), (int)offset[0]+1);
+            exit(2);
+        }
+
+#if H5_VERSION_GE(1,10,3)
+        herr_t status = H5Dwrite_chunk(tb.dataset, H5P_DEFAULT, 0, offset, enc.len[c], &enc.buf[c][0]);
+#else
+        herr_t status = H5DOwrite_chunk(tb.dataset, H5P_DEFAULT, 0, offset, enc.len[c], &enc.buf[c][0]);
+#endif
+        if (0 > status) {
+            fprintf(stderr, "ERROR: writing table %s, row %d\n", tb.name.c_str(), (int)offset[0]+1);
+            exit(2);
+        }
+    }
+}
+
+// All-zero chunks left unwritten so far
+long long OMXMatrix::getZeroChunks() {
+    return _zeroChunks;
+}
+
+// Scale-offset decimal digits of a new table, or -1 if it has no such filter
+int OMXMatrix::getScaleOffsetDigits(int table) {
+    if (table < 1 || table >= (int)_digits.size()) return -1;
+    return _digits[table];
+}
+
+// Largest absolute error the scale-offset filter introduced so far, or -1
+double OMXMatrix::getScaleOffsetError(int table) {
+    if (getScaleOffsetDigits(table) < 0) return -1;
+    return _soError[table];
+}
+
+/*
+ * Replay what H5Z_FILTER_SCALEOFFSET (D-scale) does to each chunk in the
+ * block: values within 10^-D of the 0.0 fill value become fill, the rest
+ * are stored as round(v*10^D - min*10^D) against the chunk minimum.
+ * Exact for blocks of whole chunks, as copy_data() writes them.
+ */
+void OMXMatrix::trackScaleOffsetError(int table, int firstRow, int nRows, double *data) {
+    int digits = _digits[table];
+    if (digits < 0) return;
+
+    bool single = (_storage[table].type == STORE_FLOAT32);
+    double p = pow(10.0, digits);
+    double eps = pow(10.0, -digits);
+    double maxErr = _soError[table];
+
+    int band0 = (firstRow-1) / _chunkRows;
+    int band1 = (firstRow-1 + nRows-1) / _chunkRows;
+
+    for (int band=band0; band<=band1; band++) {
+        int r0 = max(band*_chunkRows - (firstRow-1), 0);
+        int r1 = min((band+1)*_chunkRows - (firstRow-1), nRows);
+
+        for (int col0=0; col0<_nCols; col0+=_chunkCols) {
+            int col1 = min(col0+_chunkCols, _nCols);
+
+            double mn = HUGE_VAL;
+            for (int r=r0; r<r1; r++) {
+                double *row = data + (size_t)r*_nCols;
+                for (int c=col0; c<col1; c++) {
+                    double v = single ? (double)(float)row[c] : row[c];
+                    if (fabs(v) >= eps && v < mn) mn = v;
+                }
+            }
+
+            for (int r=r0; r<r1; r++) {
+                double *row = data + (size_t)r*_nCols;
+                for (int c=col0; c<col1; c++) {
+                    double v = single ? (double)(float)row[c] : row[c];
+                    if (v != v) continue;
+
+                    double decoded = 0.0;
+                    if (fabs(v) >= eps) decoded = floor(v*p - mn*p + 0.5) / p + mn;
+                    if (single) decoded = (float) decoded;
+
+                    double err = fabs(decoded - row[c]);
+                    if (err > maxErr) maxErr = err;
+                }
+            }
+        }
+    }
+
+    _soError[table] = maxErr;
+}
+
+// Rows per writeRows() block: whole chunks, about OMX_BLOCK_BYTES per table
+int OMXMatrix::getBlockRows() {
+    long long chunkBytes = (long long)_chunkRows * _nCols * sizeof(double);
+    long long chunks = OMX_BLOCK_BYTES / (chunkBytes > 0 ? chunkBytes : 1);
+    if (chunks < 1) chunks = 1;
+
+    long long rows = chunks * _chunkRows;
+    if (rows > _nRows) rows = _nRows;
+    return (int) rows;
+}
+
 //Read/Open operations ------------------------------------------------------
 
 void OMXMatrix::openFile(string filename) {
     // Try to open the existing file
-    _h5file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    hid_t fapl = create_fapl();
+    _h5file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, fapl);
+    H5Pclose(fapl);
     if (_h5file < 0) {
         fprintf(stderr, "ERROR: Can't find or open file %s",filename.c_str());
         exit(2);
@@ -142,70 +826,247 @@ int OMXMatrix::getCols() {
     return _nCols;
 }
 
+// Matrix interface: zones == rows.  A window made with -origins/-dests
+// has getCols() != getZones(), and can't be read as a square matrix.
+int OMXMatrix::getZones() {
+    return _nRows;
+}
+
 int OMXMatrix::getTables() {
     return _nTables;
 }
 
 string OMXMatrix::getTableName(int table) {
-    return _tableName[table];
+    if (table < 1 || table > _nTables) return "";
+    return _tables[table].name;
+}
+
+// Table number in file order, or -1 if there is no such table.  Table
+// numbers are the handles for all row I/O; name-based calls look them up.
+int OMXMatrix::getTableNumber(string tablename) {
+    if (_tableLookup.count(tablename)==0) return -1;
+    return _tableLookup[tablename];
 }
 
 void OMXMatrix::getRow (string table, int row, void *rowptr) {
-    hsize_t data_count[2], data_offset[2];
+    if (_tableLookup.count(table)==0) {
+        throw MatrixReadException() ;
+    }
+    getRow(_tableLookup[table], row, (double *) rowptr);
+}
 
-    // First see if we've opened this table already
-    if (_dataset.count(table)==0) {
-        // Does this table exist?
-        if (_tableLookup.count(table)==0) {
-            throw MatrixReadException() ;
-        }
-        _dataset[table] = openDataset(table);
+void OMXMatrix::getRow (int table, int row, double *rowptr) {
+    OMXTable &tb = handle(table);
+    if (tb.sparse) {
+        readSparse(tb, row, 1, 1, _nCols, rowptr);
+        return;
     }
 
+    hsize_t data_count[2], data_offset[2];
+
     data_count[0] = 1;
     data_count[1] = _nCols;
     data_offset[0] = row-1;
     data_offset[1] = 0;
 
-    // Create dataspace if necessary.  Don't do every time or we'll run OOM.
-    if (_dataspace.count(table)==0) {
-        _dataspace[table] = H5Dget_space(_dataset[table]);
-    }
-
     // Define MEMORY slab (using data_count since we don't want to read zones+1 values!)
     if (_memspace < 0) {
         _memspace = H5Screate_simple(2, data_count, NULL);
     }
 
     // Define DATA slab
-    if (0 > H5Sselect_hyperslab (_dataspace[table], H5S_SELECT_SET, data_offset, NULL, data_count, NULL)) {
+    if (0 > H5Sselect_hyperslab (tb.dataspace, H5S_SELECT_SET, data_offset, NULL, data_count, NULL)) {
         fprintf(stderr, "ERROR: Couldn't select DATA subregion for table %s, subrow %d.\n",
-                table.c_str(),row);
+                tb.name.c_str(),row);
         exit(2);
     }
 
     // Read the data!
-    if (0 > H5Dread(_dataset[table], H5T_NATIVE_DOUBLE, _memspace, _dataspace[table],
+    if (0 > H5Dread(tb.dataset, H5T_NATIVE_DOUBLE, _memspace, tb.dataspace,
             H5P_DEFAULT, rowptr)) {
-        fprintf(stderr, "ERROR: Couldn't read table %s, subrow %d.\n",table.c_str(),row);
+        fprintf(stderr, "ERROR: Couldn't read table %s, subrow %d.\n",tb.name.c_str(),row);
         exit(2);
     }
+
+    if (tb.readScale != 1.0) {
+        for (int i=0; i<_nCols; i++) rowptr[i] /= tb.readScale;
+    }
 }
 
-void OMXMatrix::closeFile() {
-    for(map<string,hid_t>::iterator iterator = _dataset.begin(); iterator != _dataset.end(); iterator++) {
-        H5Dclose(iterator->second);
+/*
+ * Read nRows consecutive rows with a single H5Dread, packed nCols apart
+ * in data.  Far cheaper than nRows calls to getRow().
+ */
+void OMXMatrix::getRows(string table, int firstRow, int nRows, double *data) {
+    getRows(tableNumber(table), firstRow, nRows, data);
+}
+
+void OMXMatrix::getRows(int table, int firstRow, int nRows, double *data) {
+    OMXTable &tb = handle(table);
+    if (tb.sparse) {
+        readSparse(tb, firstRow, nRows, 1, _nCols, data);
+        return;
+    }
+
+    hsize_t count[2], offset[2];
+
+    count[0] = nRows;
+    count[1] = _nCols;
+    offset[0] = firstRow-1;
+    offset[1] = 0;
+
+    // Same cached memory dataspace as writeRows(); blocks are nearly always the same size
+    if (_blockspace < 0 || _blockspaceRows != nRows) {
+        if (_blockspace > -1) H5Sclose(_blockspace);
+        _blockspace = H5Screate_simple(2,count,NULL);
+        _blockspaceRows = nRows;
+    }
+
+    if (0 > H5Sselect_hyperslab (tb.dataspace, H5S_SELECT_SET, offset, NULL, count, NULL)) {
+        fprintf(stderr, "ERROR: Couldn't select rows %d-%d of table %s.\n",
+                firstRow, firstRow+nRows-1, tb.name.c_str());
+        exit(2);
+    }
+
+    if (0 > H5Dread(tb.dataset, H5T_NATIVE_DOUBLE, _blockspace, tb.dataspace,
+            H5P_DEFAULT, data)) {
+        fprintf(stderr, "ERROR: Couldn't read table %s, rows %d-%d.\n",
+                tb.name.c_str(), firstRow, firstRow+nRows-1);
+        exit(2);
+    }
+
+    if (tb.readScale != 1.0) {
+        size_t n = (size_t)nRows * _nCols;
+        for (size_t i=0; i<n; i++) data[i] /= tb.readScale;
+    }
+}
+
+void OMXMatrix::getTable(string table, double *data) {
+    getRows(tableNumber(table), 1, _nRows, data);
+}
+
+void OMXMatrix::getTable(int table, double *data) {
+    getRows(table, 1, _nRows, data);
+}
+
+// Cell j of a row, both numbered from 1, through an LRU cache of chunks
+double OMXMatrix::getValue(string table, int row, int j) {
+    return getValue(tableNumber(table), row, j);
+}
+
+double OMXMatrix::getValue(int table, int row, int j) {
+    if (_cells == NULL) _cells = new CellCache(this);
+    return _cells->getValue(table, row, j);
+}
+
+void OMXMatrix::getValues(int table, vector< pair<int,int> > &cells, double *values) {
+    if (_cells == NULL) _cells = new CellCache(this);
+    _cells->getValues(table, cells, values);
+}
+
+// A single cell costs a whole chunk to decode
+void OMXMatrix::getTileShape(int table, int &rows, int &cols) {
+    OMXTable &tb = handle(table);
+
+    rows = 1;
+    cols = _nCols;
+    if (tb.sparse) return;
+
+    hid_t dcpl = H5Dget_create_plist(tb.dataset);
+    if (H5Pget_layout(dcpl) == H5D_CHUNKED) {
+        hsize_t chunk[2];
+        H5Pget_chunk(dcpl, 2, chunk);
+        rows = (int) chunk[0];
+        cols = (int) chunk[1];
+    }
+    H5Pclose(dcpl);
+}
+
+void OMXMatrix::getTile(int table, int firstRow, int nRows, int firstCol, int nCols, double *data) {
+    OMXTable &tb = handle(table);
+    if (tb.sparse) {
+        readSparse(tb, firstRow, nRows, firstCol, nCols, data);
+        return;
+    }
+
+    hsize_t count[2], offset[2];
+
+    count[0] = nRows;
+    count[1] = nCols;
+    offset[0] = firstRow-1;
+    offset[1] = firstCol-1;
+
+    hid_t tilespace = H5Screate_simple(2, count, NULL);
+    H5Sselect_hyperslab(tb.dataspace, H5S_SELECT_SET, offset, NULL, count, NULL);
+
+    if (0 > H5Dread(tb.dataset, H5T_NATIVE_DOUBLE, tilespace, tb.dataspace,
+            H5P_DEFAULT, data)) {
+        fprintf(stderr, "ERROR: Couldn't read table %s, rows %d-%d, columns %d-%d.\n",
+                tb.name.c_str(), firstRow, firstRow+nRows-1, firstCol, firstCol+nCols-1);
+        exit(2);
+    }
+    H5Sclose(tilespace);
+
+    if (tb.readScale != 1.0) {
+        size_t n = (size_t)nRows * nCols;
+        for (size_t i=0; i<n; i++) data[i] /= tb.readScale;
     }
+}
+
+/*
+ * Rows per getRows() block when copying every table: the whole table if
+ * all tables fit in OMX_READ_BLOCK_BYTES, else as many whole chunk bands
+ * as fit, and at least one.  Bands are whole chunks of every dense table
+ * (the lcm of their chunk rows), or of the table with the tallest chunks
+ * if the lcm is more rows than there are.
+ */
+int OMXMatrix::getReadBlockRows() {
+    size_t rowBytes = (size_t)_nCols * sizeof(double) * (_nTables > 0 ? _nTables : 1);
+    size_t rows = OMX_READ_BLOCK_BYTES / rowBytes;
+    if (rows >= (size_t)_nRows) return _nRows;
+
+    long long band = 1;
+    int tallest = 1;
+    for (int t=1; t<=_nTables; t++) {
+        int chunkRows, chunkCols;
+        getTileShape(t, chunkRows, chunkCols);      // sparse: 1 row
+        if (chunkRows > tallest) tallest = chunkRows;
+        if (band <= _nRows) band = lcm(band, chunkRows);
+    }
+    if (band > _nRows) band = tallest;
+
+    rows -= rows % band;
+    if (rows < (size_t)band) rows = band;
+    return (int) rows;
+}
 
-    for(map<string,hid_t>::iterator iterator = _dataspace.begin(); iterator != _dataspace.end(); iterator++) {
-        H5Sclose(iterator->second);
+void OMXMatrix::closeFile() {
+    for (unsigned int t=1; t<_tables.size(); t++) {
+        if (_mode == MODE_CREATE && _tables[t].sparse) finishSparse(t);
+
+        if (_tables[t].dataset > -1) H5Dclose(_tables[t].dataset);
+        if (_tables[t].dataspace > -1) H5Sclose(_tables[t].dataspace);
+        if (_tables[t].indices > -1) H5Dclose(_tables[t].indices);
     }
+    _tables.assign(1, OMXTable());
 
     if (_memspace > -1 ) {
         H5Sclose(_memspace);
         _memspace = -1;
     }
 
+    if (_blockspace > -1 ) {
+        H5Sclose(_blockspace);
+        _blockspace = -1;
+    }
+
+    delete _pool;
+    _pool = NULL;
+    delete _cells;
+    _cells = NULL;
+    _encoded.buf.clear();
+    _encoded.len.clear();
+
     if (_fileOpen==true) {
         H5Fclose(_h5file);
     }
@@ -216,11 +1077,11 @@ int OMXMatrix::getCubeNumber(string tablename) {
 
     string path = "/data/" + tablename;
 
-    hid_t leaf = H5Dopen(_h5file, path.c_str(), H5P_DEFAULT);
+    hid_t leaf = H5Oopen(_h5file, path.c_str(), H5P_DEFAULT);
     if (leaf<0) return -1;
 
     herr_t exists = H5LTfind_attribute(leaf, CUBE_MAT_NUMBER);
-    H5Dclose(leaf);    
+    H5Oclose(leaf);
 
     if (exists==0) return -1;
 
@@ -233,6 +1094,48 @@ int OMXMatrix::getCubeNumber(string tablename) {
 
 // ---- Private functions ---------------------------------------------------
 
+// Table number for a name-based call
+int OMXMatrix::tableNumber(string table) {
+    if (_tableLookup.count(table)==0) {
+            throw NoSuchTableException();
+    }
+    return _tableLookup[table];
+}
+
+// The table behind a table number, opened for reading the first time
+OMXTable& OMXMatrix::handle(int table) {
+    if (table < 1 || table > _nTables) {
+        throw NoSuchTableException();
+    }
+
+    OMXTable &tb = _tables[table];
+    if (tb.dataset < 0) {
+        string path = "/data/" + tb.name;
+
+        // Sparse tables are groups; dense ones are datasets
+        hid_t obj = H5Oopen(_h5file, path.c_str(), H5P_DEFAULT);
+        if (obj < 0) {
+            throw InvalidOperationException();
+        }
+        bool group = (H5Iget_type(obj) == H5I_GROUP);
+        H5Oclose(obj);
+
+        if (group) openSparse(tb);
+        else tb.dataset = openDataset(tb.name);
+
+        // Scaled integer tables read back divided by their scale
+        if (H5Aexists_by_name(_h5file, path.c_str(), STORAGE_SCALE, H5P_DEFAULT) > 0) {
+            H5LTget_attribute_double(_h5file, path.c_str(), STORAGE_SCALE, &tb.readScale);
+        }
+    }
+
+    // Create dataspace if necessary.  Don't do every time or we'll run OOM.
+    if (tb.dataspace < 0 && !tb.sparse) {
+        tb.dataspace = H5Dget_space(tb.dataset);
+    }
+    return tb;
+}
+
 hid_t OMXMatrix::openDataset(string table) {
 
     string tname = "/data/" + table;
@@ -242,9 +1145,83 @@ hid_t OMXMatrix::openDataset(string table) {
         throw InvalidOperationException();
     }
 
+    // The chunk cache is set when a dataset is opened, so size it from this
+    // table's chunk shape and open it again
+    hid_t dcpl = H5Dget_create_plist(dataset);
+    if (H5Pget_layout(dcpl) == H5D_CHUNKED) {
+        hsize_t chunk[2];
+        hid_t type = H5Dget_type(dataset);
+        H5Pget_chunk(dcpl, 2, chunk);
+
+        hid_t dapl = create_dapl(chunk[0], chunk[1], H5Tget_size(type));
+        H5Dclose(dataset);
+        dataset = H5Dopen(_h5file, tname.c_str(), dapl);
+
+        H5Pclose(dapl);
+        H5Tclose(type);
+    }
+    H5Pclose(dcpl);
+
+    if (dataset < 0) {
+        throw InvalidOperationException();
+    }
     return dataset;
 }
 
+// File access properties: metadata cache and sieve buffer
+hid_t OMXMatrix::create_fapl() {
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+
+    if (_cache.metaCacheBytes > 0) {
+        H5AC_cache_config_t mdc;
+        mdc.version = H5AC__CURR_CACHE_CONFIG_VERSION;
+        H5Pget_mdc_config(fapl, &mdc);
+
+        mdc.set_initial_size = true;
+        mdc.initial_size = _cache.metaCacheBytes;
+        if (mdc.max_size < mdc.initial_size) mdc.max_size = mdc.initial_size;
+        if (mdc.min_size > mdc.initial_size) mdc.min_size = mdc.initial_size;
+        H5Pset_mdc_config(fapl, &mdc);
+    }
+
+    if (_cache.sieveBytes > 0) {
+        H5Pset_sieve_buf_size(fapl, _cache.sieveBytes);
+    }
+
+    return fapl;
+}
+
+/*
+ * Dataset access properties: the chunk cache.  HDF5's default 1 MB cache
+ * can't hold a band of large chunks, so reading a table row by row would
+ * inflate each chunk once per row.  By default the cache holds one full
+ * band of chunks, limited to this table's share of OMX_CACHE_BUDGET.
+ */
+hid_t OMXMatrix::create_dapl(hsize_t chunkRows, hsize_t chunkCols, size_t elemSize) {
+    size_t chunkBytes = (size_t)(chunkRows * chunkCols) * elemSize;
+    size_t tiles = (_nCols + chunkCols - 1) / chunkCols;
+
+    size_t bytes = _cache.chunkCacheBytes;
+    if (bytes == 0) {
+        size_t share = OMX_CACHE_BUDGET / (_nTables > 0 ? _nTables : 1);
+        bytes = min(tiles * chunkBytes, share);
+        if (bytes < OMX_MIN_CHUNK_CACHE) bytes = OMX_MIN_CHUNK_CACHE;
+    }
+
+    size_t slots = _cache.chunkCacheSlots;
+    if (slots == 0) {
+        size_t chunks = bytes / (chunkBytes > 0 ? chunkBytes : 1);
+        slots = nextPrime(max(chunks * 100, (size_t)OMX_MIN_CACHE_SLOTS));
+    }
+
+    double w0 = _cache.preemption;
+    if (w0 < 0) w0 = H5D_CHUNK_CACHE_W0_DEFAULT;
+
+    hid_t dapl = H5Pcreate(H5P_DATASET_ACCESS);
+    H5Pset_chunk_cache(dapl, slots, bytes, w0);
+    return dapl;
+}
+
 /*
  * Group traversal function. Build list of tablenames from this.
  */
@@ -253,7 +1230,8 @@ herr_t _leaf_info(hid_t loc_id, const char *name, const H5L_info_t *info, void *
     OMXMatrix *m = (OMXMatrix *) opdata;
 
     m->_nTables++;
-    m->_tableName[m->_nTables] = name;
+    m->_tables.push_back(OMXTable());
+    m->_tables.back().name = name;
     m->_tableLookup[name] = m->_nTables;
     return 0;
 }
@@ -262,9 +1240,8 @@ herr_t _leaf_info(hid_t loc_id, const char *name, const H5L_info_t *info, void *
 void OMXMatrix::readTableNames() {
 
     _nTables = 0;
+    _tables.assign(1, OMXTable());
     _tableLookup.clear();
-    _dataset.clear();
-    _dataspace.clear();
     unsigned flags = 0;
 
     hid_t datagroup = H5Gopen(_h5file, "/data", H5P_DEFAULT);
@@ -292,41 +1269,363 @@ void OMXMatrix::init_tables (vector<string> &tableNames) {
     hsize_t     dims[2]={_nRows,_nCols};
     hid_t       plist;
     herr_t      rtn;
-    hsize_t     chunksize[2];
-    double      fillvalue[1];
 
-    fillvalue[0] = 0.0;
-    chunksize[0] = 1;
-    chunksize[1] = _nCols;
+    choose_chunks();
 
     hid_t   dataspace = H5Screate_simple(2,dims, NULL);
 
-    // Use a row-chunked, zip-compressed data format:
-    plist = H5Pcreate(H5P_DATASET_CREATE);
-    rtn = H5Pset_chunk(plist, 2, chunksize);
-    rtn = H5Pset_deflate(plist, 7);
-    rtn = H5Pset_fill_value(plist, H5T_NATIVE_DOUBLE, &fillvalue);
+    _tables.assign(tableNames.size()+1, OMXTable());
+    _storage.assign(tableNames.size()+1, _options.storage);
+    _digits.assign(tableNames.size()+1, -1);
+    _soError.assign(tableNames.size()+1, 0.0);
 
     // Loop on all TP+ tables
     for (unsigned int t=0; t<tableNames.size(); t++) {
         string tpath = "/data/" + tableNames[t];
         string tname(tableNames[t]);
-        
-        // Create a dataset for each table
-        _dataset[tname] = H5Dcreate2(_h5file, tpath.c_str(), H5T_NATIVE_DOUBLE,
-                                 dataspace, H5P_DEFAULT, plist, H5P_DEFAULT);
-        if (_dataset[tname]<0) {
-            fprintf(stderr, "Error creating dataset %s",tpath.c_str());
-            exit(2);
-        }
-        
-        // Save the something somewhere
+
+        int digits;
+        bool sparse;
+        resolveTable(tname, _storage[t+1], digits, sparse, true);
+        const OMXStorage &storage = _storage[t+1];
+        _digits[t+1] = digits;
+        _tables[t+1].name = tname;
         _tableLookup[tname] = t+1;
+
+        if (sparse) {
+            createSparse(t+1, tpath);
+        } else {
+            plist = create_plist(t+1);
+            hid_t dapl = create_dapl(_chunkRows, _chunkCols, storageSize(storage.type));
+
+            // Create a dataset for each table
+            hid_t dataset = H5Dcreate2(_h5file, tpath.c_str(), storageType(storage.type),
+                                     dataspace, H5P_DEFAULT, plist, dapl);
+            H5Pclose(dapl);
+            if (dataset<0) {
+                fprintf(stderr, "Error creating dataset %s",tpath.c_str());
+                exit(2);
+            }
+            _tables[t+1].dataset = dataset;
+            rtn = H5Pclose(plist);
+        }
+
+        if (storage.type == STORE_SCALED) {
+            H5LTset_attribute_double(_h5file, tpath.c_str(), STORAGE_SCALE, &storage.scale, 1);
+        }
+
         int cube_num = t+1;
         H5LTset_attribute_int(_h5file, tpath.c_str(), CUBE_MAT_NUMBER, &cube_num, 1);
     }
 
-    rtn = H5Pclose(plist);
     rtn = H5Sclose(dataspace);
 }
 
+/*
+ * Storage type, scale-offset digits (-1 = off) and sparse layout for a new
+ * table, from the write options.  With notes, says when a filter that was
+ * asked for can't be used.
+ */
+void OMXMatrix::resolveTable(string table, OMXStorage &storage, int &digits, bool &sparse, bool notes) {
+    storage = _options.storage;
+    if (_options.tableStorage.count(table)) storage = _options.tableStorage[table];
+
+    // Scale-offset digits: first matching pattern, else the global setting
+    digits = _options.digits;
+    for (unsigned int i=0; i<_options.digitPatterns.size(); i++) {
+        if (globMatch(_options.digitPatterns[i].first.c_str(), table.c_str())) {
+            digits = _options.digitPatterns[i].second;
+            break;
+        }
+    }
+    if (digits >= 0 && storage.type != STORE_FLOAT64 && storage.type != STORE_FLOAT32) {
+        if (notes) fprintf(stderr, "Note: no scale-offset filter for integer table %s\n", table.c_str());
+        digits = -1;
+    }
+
+    sparse = false;
+    for (unsigned int i=0; i<_options.sparsePatterns.size(); i++) {
+        if (globMatch(_options.sparsePatterns[i].c_str(), table.c_str())) sparse = true;
+    }
+    if (sparse && digits >= 0) {
+        if (notes) fprintf(stderr, "Note: no scale-offset filter for sparse table %s\n", table.c_str());
+        digits = -1;
+    }
+}
+
+// ---- Sparse (CSR) tables --------------------------------------------------
+
+/*
+ * A sparse table's group, with empty extendible "indices" and "data"
+ * datasets that rows are appended to.  "indptr" is written by
+ * finishSparse() once every row is in.
+ */
+void OMXMatrix::createSparse(int table, string path) {
+    OMXTable &tb = _tables[table];
+
+    hid_t group = H5Gcreate2(_h5file, path.c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (group < 0) {
+        fprintf(stderr, "Error creating sparse table %s", path.c_str());
+        exit(2);
+    }
+    H5LTset_attribute_string(_h5file, path.c_str(), SPARSE_FORMAT, SPARSE_CSR);
+
+    hsize_t dims[1] = {0}, maxdims[1] = {H5S_UNLIMITED}, chunk[1] = {SPARSE_CHUNK};
+    hid_t space = H5Screate_simple(1, dims, maxdims);
+    hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(plist, 1, chunk);
+    if (_options.deflate > 0) {
+        if (_options.shuffle) H5Pset_shuffle(plist);
+        H5Pset_deflate(plist, _options.deflate);
+    }
+
+    tb.indices = H5Dcreate2(group, "indices", H5T_NATIVE_INT, space, H5P_DEFAULT, plist, H5P_DEFAULT);
+    tb.dataset = H5Dcreate2(group, "data", storageType(_storage[table].type), space,
+                            H5P_DEFAULT, plist, H5P_DEFAULT);
+    H5Pclose(plist);
+    H5Sclose(space);
+    H5Gclose(group);
+
+    if (tb.indices < 0 || tb.dataset < 0) {
+        fprintf(stderr, "Error creating sparse table %s", path.c_str());
+        exit(2);
+    }
+    tb.sparse = true;
+    tb.indptr.assign(1, 0);
+}
+
+// Open a sparse table's datasets, and read its row offsets
+void OMXMatrix::openSparse(OMXTable &tb) {
+    string path = "/data/" + tb.name;
+
+    hsize_t dims[1];
+    H5T_class_t type;
+    size_t size = 0;
+    char format[16] = "";
+    if (H5Aexists_by_name(_h5file, path.c_str(), SPARSE_FORMAT, H5P_DEFAULT) > 0) {
+        H5LTget_attribute_info(_h5file, path.c_str(), SPARSE_FORMAT, dims, &type, &size);
+        if (type == H5T_STRING && size < sizeof(format)) {
+            H5LTget_attribute_string(_h5file, path.c_str(), SPARSE_FORMAT, format);
+        }
+    }
+    if (strcmp(format, SPARSE_CSR) != 0) {
+        fprintf(stderr, "ERROR: %s is not a table or a CSR sparse table\n", path.c_str());
+        exit(2);
+    }
+
+    tb.indices = H5Dopen(_h5file, (path + "/indices").c_str(), H5P_DEFAULT);
+    tb.dataset = H5Dopen(_h5file, (path + "/data").c_str(), H5P_DEFAULT);
+    hid_t indptr = H5Dopen(_h5file, (path + "/indptr").c_str(), H5P_DEFAULT);
+    if (tb.indices < 0 || tb.dataset < 0 || indptr < 0) {
+        fprintf(stderr, "ERROR: sparse table %s is missing indptr, indices or data\n", tb.name.c_str());
+        exit(2);
+    }
+
+    hid_t space = H5Dget_space(indptr);
+    hssize_t n = H5Sget_simple_extent_npoints(space);
+    H5Sclose(space);
+    space = H5Dget_space(tb.dataset);
+    hssize_t entries = H5Sget_simple_extent_npoints(space);
+    H5Sclose(space);
+
+    bool ok = (n == _nRows+1);
+    if (ok) {
+        tb.indptr.resize(n);
+        ok = (0 <= H5Dread(indptr, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, &tb.indptr[0]));
+    }
+    for (int r=0; ok && r<_nRows; r++) {
+        ok = (tb.indptr[r] <= tb.indptr[r+1]);
+    }
+    if (!ok || tb.indptr[0] != 0 || tb.indptr[_nRows] > entries) {
+        fprintf(stderr, "ERROR: sparse table %s has a bad indptr\n", tb.name.c_str());
+        exit(2);
+    }
+    H5Dclose(indptr);
+    tb.sparse = true;
+}
+
+/*
+ * Add a row's nonzero values to the table's buffer, and the buffer to the
+ * file when it fills.  Rows must come in order; rows skipped are empty.
+ */
+void OMXMatrix::appendSparse(int table, int row, double *rowdata) {
+    OMXTable &tb = _tables[table];
+
+    int done = tb.indptr.size() - 1;
+    if (row <= done) {
+        fprintf(stderr, "ERROR: sparse table %s must be written in row order (row %d after %d)\n",
+                tb.name.c_str(), row, done);
+        exit(2);
+    }
+
+    long long end = tb.stored + tb.pendingCols.size();
+    while ((int)tb.indptr.size() < row) tb.indptr.push_back(end);
+
+    if (!allZero(rowdata, _nCols)) {
+        for (int j=0; j<_nCols; j++) {
+            if (rowdata[j] != 0.0) {
+                tb.pendingCols.push_back(j);
+                tb.pendingValues.push_back(rowdata[j]);
+            }
+        }
+    }
+    tb.indptr.push_back(tb.stored + tb.pendingCols.size());
+
+    if (tb.pendingCols.size() >= SPARSE_FLUSH_ENTRIES) flushSparse(table);
+}
+
+// Append the buffered entries to the indices and data datasets
+void OMXMatrix::flushSparse(int table) {
+    OMXTable &tb = _tables[table];
+    hsize_t count[1] = { tb.pendingCols.size() };
+    if (count[0] == 0) return;
+
+    hsize_t offset[1] = { (hsize_t) tb.stored };
+    hsize_t size[1] = { tb.stored + count[0] };
+
+    hid_t memtype;
+    void *buf = toStorage(table, &tb.pendingValues[0], count[0], memtype);
+    hid_t memspace = H5Screate_simple(1, count, NULL);
+
+    bool ok = (0 <= H5Dset_extent(tb.indices, size) && 0 <= H5Dset_extent(tb.dataset, size));
+    if (ok) {
+        hid_t space = H5Dget_space(tb.indices);
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+        ok = (0 <= H5Dwrite(tb.indices, H5T_NATIVE_INT, memspace, space, H5P_DEFAULT, &tb.pendingCols[0]));
+        H5Sclose(space);
+    }
+    if (ok) {
+        hid_t space = H5Dget_space(tb.dataset);
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+        ok = (0 <= H5Dwrite(tb.dataset, memtype, memspace, space, H5P_DEFAULT, buf));
+        H5Sclose(space);
+    }
+    H5Sclose(memspace);
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: writing sparse table %s\n", tb.name.c_str());
+        exit(2);
+    }
+
+    tb.stored += count[0];
+    tb.pendingCols.clear();
+    tb.pendingValues.clear();
+}
+
+// Flush the last entries and write the row offsets
+void OMXMatrix::finishSparse(int table) {
+    OMXTable &tb = _tables[table];
+
+    long long end = tb.stored + tb.pendingCols.size();
+    while ((int)tb.indptr.size() <= _nRows) tb.indptr.push_back(end);
+    flushSparse(table);
+
+    string path = "/data/" + tb.name + "/indptr";
+    hsize_t dims[1] = { tb.indptr.size() };
+    hid_t space = H5Screate_simple(1, dims, NULL);
+    hid_t indptr = H5Dcreate2(_h5file, path.c_str(), H5T_STD_I64LE, space,
+                              H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+    if (indptr < 0 ||
+        0 > H5Dwrite(indptr, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, &tb.indptr[0])) {
+        fprintf(stderr, "ERROR: writing sparse table %s\n", tb.name.c_str());
+        exit(2);
+    }
+    H5Dclose(indptr);
+    H5Sclose(space);
+}
+
+/*
+ * Rows firstRow.. of a sparse table, cut to columns firstCol..firstCol+nCols-1
+ * and packed nCols apart.  Reads only the rows' entries, in one go.
+ */
+void OMXMatrix::readSparse(OMXTable &tb, int firstRow, int nRows, int firstCol, int nCols, double *data) {
+    memset(data, 0, (size_t)nRows * nCols * sizeof(double));
+
+    long long lo = tb.indptr[firstRow-1];
+    long long hi = tb.indptr[firstRow-1 + nRows];
+    if (hi <= lo) return;
+
+    hsize_t offset[1] = { (hsize_t) lo };
+    hsize_t count[1] = { (hsize_t)(hi - lo) };
+    _sparseCols.resize(count[0]);
+    _sparseValues.resize(count[0]);
+
+    hid_t memspace = H5Screate_simple(1, count, NULL);
+    hid_t space = H5Dget_space(tb.indices);
+    H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+    herr_t status = H5Dread(tb.indices, H5T_NATIVE_INT, memspace, space, H5P_DEFAULT, &_sparseCols[0]);
+    H5Sclose(space);
+
+    if (status >= 0) {
+        space = H5Dget_space(tb.dataset);
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+        status = H5Dread(tb.dataset, H5T_NATIVE_DOUBLE, memspace, space, H5P_DEFAULT, &_sparseValues[0]);
+        H5Sclose(space);
+    }
+    H5Sclose(memspace);
+
+    if (status < 0) {
+        fprintf(stderr, "ERROR: Couldn't read sparse table %s, rows %d-%d.\n",
+                tb.name.c_str(), firstRow, firstRow+nRows-1);
+        exit(2);
+    }
+
+    for (int r=0; r<nRows; r++) {
+        double *row = data + (size_t)r * nCols;
+        for (long long e = tb.indptr[firstRow-1 + r]; e < tb.indptr[firstRow + r]; e++) {
+            int j = _sparseCols[e - lo] - (firstCol-1);
+            if (j >= 0 && j < nCols) row[j] = _sparseValues[e - lo] / tb.readScale;
+        }
+    }
+}
+
+// Dataset creation properties for a new table: chunking and filters
+hid_t OMXMatrix::create_plist(int table) {
+    hsize_t     chunksize[2];
+    double      fillvalue[1];
+
+    fillvalue[0] = 0.0;
+    chunksize[0] = _chunkRows;
+    chunksize[1] = _chunkCols;
+
+    // Use a chunked, (by default) zip-compressed data format:
+    hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(plist, 2, chunksize);
+    if (_digits[table] >= 0) {
+        // Lossy but bounded: keep <digits> decimal places, then compress the rest
+        H5Pset_scaleoffset(plist, H5Z_SO_FLOAT_DSCALE, _digits[table]);
+    }
+    if (_options.deflate > 0) {
+        if (_options.shuffle) H5Pset_shuffle(plist);
+        H5Pset_deflate(plist, _options.deflate);
+    }
+    H5Pset_fill_value(plist, H5T_NATIVE_DOUBLE, &fillvalue);
+
+    return plist;
+}
+
+/*
+ * Settle the chunk shape for new tables.  The "auto" profile uses row
+ * bands of about AUTO_ROW_CHUNK_BYTES for row access, and square
+ * AUTO_TILE_SIZE tiles for block/column access.
+ */
+void OMXMatrix::choose_chunks() {
+    if (_options.autoChunk) {
+        if (_options.access == ACCESS_TILE) {
+            _chunkRows = AUTO_TILE_SIZE;
+            _chunkCols = AUTO_TILE_SIZE;
+        } else {
+            int rowBytes = _nCols * sizeof(double);
+            _chunkRows = (AUTO_ROW_CHUNK_BYTES + rowBytes - 1) / rowBytes;
+            _chunkCols = _nCols;
+        }
+    } else {
+        _chunkRows = _options.chunkRows;
+        _chunkCols = _options.chunkCols;
+    }
+
+    // Chunks can't be empty, or larger than the table
+    if (_chunkRows < 1 || _chunkRows > _nRows) _chunkRows = _nRows;
+    if (_chunkCols < 1 || _chunkCols > _nCols) _chunkCols = _nCols;
+}
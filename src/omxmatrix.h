@@ -13,6 +13,12 @@
 #include <hdf5.h>
 #include <hdf5_hl.h>
 
+#include "cellcache.h"
+#include "kernels.h"
+#include "matrixio.h"
+#include "stats.h"
+#include "threadpool.h"
+
 using namespace std;
 
 //--------------------------------------------------------------------
@@ -22,31 +28,188 @@ using namespace std;
 #define  MODE_READ    0
 #define  MODE_CREATE  1
 
-#define  MAX_TABLES  500
-
 #define CUBE_MAT_NUMBER "CUBE_MAT_NUMBER"
 
-class OMXMatrix {
+// Summary statistics stored with each table by writeStats()
+#define  STAT_TOTAL     "STAT_TOTAL"
+#define  STAT_MIN       "STAT_MIN"
+#define  STAT_MAX       "STAT_MAX"
+#define  STAT_NONZERO   "STAT_NONZERO"
+#define  STAT_NAN       "STAT_NAN"
+#define  STAT_INF       "STAT_INF"
+#define  STATS_GROUP    "/stats"
+
+// Hash of a table's contents (see tablehash.h), for -incremental
+#define  CONTENT_HASH   "CONTENT_HASH"
+#define  WRITE_SETTINGS "WRITE_SETTINGS"  // write options the table was stored with
+
+// Where -incremental parks each table's link while it reorders /data:
+// outside /data, so it can't be a table's name
+#define  REORDER_LINK   "/.reorder"
+
+// Target size of one table's row block for writeRows() callers
+#define  OMX_BLOCK_BYTES  (1024*1024)
+
+// Target getReadBlockRows() block, all tables together.  Larger blocks
+// fall out of cache between the read and write stages and copy slower.
+#define  OMX_READ_BLOCK_BYTES  (1024*1024)
+
+// Access pattern that the "auto" chunk profile optimizes for
+#define  ACCESS_ROW   0
+#define  ACCESS_TILE  1
+
+// Chunk size targets for the "auto" profile
+#define  AUTO_ROW_CHUNK_BYTES  (64*1024)
+#define  AUTO_TILE_SIZE        128
+
+// On-disk value type of a table
+#define  STORE_FLOAT64  0
+#define  STORE_FLOAT32  1
+#define  STORE_INT32    2
+#define  STORE_SCALED   3    // int32 holding round(value * scale)
+
+// Attribute holding the scale of STORE_SCALED tables; readers divide by it
+#define  STORAGE_SCALE  "STORAGE_SCALE"
+
+// Sparse tables: /data/<table> is a group holding the nonzero values in
+// CSR form, as datasets "indptr" (int64, rows+1 offsets into the other
+// two), "indices" (int32 column, from 0) and "data" (the values, in the
+// table's storage type), and this attribute set to "CSR"
+#define  SPARSE_FORMAT  "SPARSE_FORMAT"
+#define  SPARSE_CSR     "CSR"
+
+// Entries buffered per sparse table before they are appended to the file
+#define  SPARSE_FLUSH_ENTRIES  (256*1024)
+
+// Chunk length of sparse tables' indices and data datasets
+#define  SPARSE_CHUNK  (16*1024)
+
+struct OMXStorage {
+    int      type;
+    double   scale;        // STORE_SCALED only
+
+    OMXStorage() : type(STORE_FLOAT64), scale(1.0) {}
+};
+
+// Storage layout and filters for newly created tables
+struct OMXWriteOptions {
+    bool     autoChunk;    // pick chunk shape from zone count and access
+    int      access;       // ACCESS_ROW or ACCESS_TILE, for autoChunk
+    int      chunkRows;
+    int      chunkCols;    // 0 = full row width
+    int      deflate;      // zlib level 1-9; 0 = no compression
+    bool     shuffle;      // byte-shuffle filter ahead of deflate
+    int      threads;      // chunk compression threads; 0 = one per core,
+                           // 1 = compress inside the HDF5 filter pipeline
+    OMXStorage storage;    // value type for all tables...
+    map<string,OMXStorage> tableStorage;   // ...except these
+    int      digits;       // scale-offset filter decimal digits; -1 = off...
+    vector< pair<string,int> > digitPatterns;   // ...except tables matching
+                                                // these, first match wins
+    vector<string> sparsePatterns;  // tables matching any of these are
+                                    // stored sparse (CSR)
+
+    OMXWriteOptions() : autoChunk(false), access(ACCESS_ROW), chunkRows(1),
+                        chunkCols(0), deflate(7), shuffle(false), threads(0),
+                        digits(-1) {}
+};
+
+// Total chunk cache shared by a file's tables when sizes are left to the heuristic
+#define  OMX_CACHE_BUDGET  (256*1024*1024)
+
+// Never go below HDF5's own chunk cache defaults
+#define  OMX_MIN_CHUNK_CACHE  (1024*1024)
+#define  OMX_MIN_CACHE_SLOTS  521
+
+// HDF5 file and dataset access tuning; zero/negative values mean "choose"
+struct OMXCacheOptions {
+    size_t   chunkCacheBytes;  // chunk cache per table; 0 = one chunk band
+                               // within an even share of OMX_CACHE_BUDGET
+    size_t   chunkCacheSlots;  // hash slots; 0 = prime near 100 x chunks cached
+    double   preemption;       // 0-1, weight for evicting fully read chunks;
+                               // < 0 = HDF5 default (0.75)
+    size_t   metaCacheBytes;   // initial metadata cache size; 0 = HDF5 default
+    size_t   sieveBytes;       // sieve buffer size; 0 = HDF5 default
+
+    OMXCacheOptions() : chunkCacheBytes(0), chunkCacheSlots(0), preemption(-1),
+                        metaCacheBytes(0), sieveBytes(0) {}
+};
+
+// One table, as resolved from its name: what row I/O works with
+struct OMXTable {
+    string   name;
+    hid_t    dataset;      // -1 until opened; sparse: the "data" dataset
+    hid_t    dataspace;    // -1 until first used
+    double   readScale;    // values read back are divided by this
+
+    bool     sparse;       // CSR group rather than a dense dataset
+    hid_t    indices;      // sparse: the "indices" dataset
+    vector<long long> indptr;   // sparse: row r is entries indptr[r-1]..indptr[r]-1
+    long long stored;      // sparse writes: entries already in the file
+    vector<int> pendingCols;    // sparse writes: entries not yet flushed
+    vector<double> pendingValues;
+    vector<unsigned char> bandNonzero;  // dense writes: tiles of the chunk band
+                                        // being written with a nonzero value
+
+    OMXTable() : dataset(-1), dataspace(-1), readScale(1.0), sparse(false),
+                 indices(-1), stored(0) {}
+};
+
+class OMXMatrix : public MatrixSource, public MatrixSink {
 public:
     OMXMatrix();
 
     virtual  ~OMXMatrix();
 
+    void     setCacheOptions(OMXCacheOptions &options);   // call before openFile/createFile
     void     openFile(string fileName);
     void     closeFile();
 
     //Read/Open operations
     int      getRows();
     int      getCols();
+    int      getZones();
     int      getTables();
     int      getCubeNumber(string tablename);
+    int      getTableNumber(string tablename);
     void     getRow (string table, int row, void *rowptr);  // throws InvalidOperationException, MatrixReadException
+    void     getRow (int table, int row, double *rowptr);
+    void     getRows(string table, int firstRow, int nRows, double *data);
+    void     getRows(int table, int firstRow, int nRows, double *data);
+    void     getTable(string table, double *data);     // _nRows x _nCols values
+    void     getTable(int table, double *data);
+    int      getReadBlockRows();
     double   getValue(string table, int row, int j);
+    double   getValue(int table, int row, int j);
+    void     getValues(int table, vector< pair<int,int> > &cells, double *values);
+    void     getTileShape(int table, int &rows, int &cols);
+    void     getTile(int table, int firstRow, int nRows, int firstCol, int nCols, double *data);
     string   getTableName(int table);
 
     //Write/Create operations
+    void     setWriteOptions(OMXWriteOptions &options);   // call before createFile
     void     createFile(int tables, int rows, int cols, vector<string> &matNames, string fileName);
+    void     updateFile(vector<string> &order, vector<string> &replaced, vector<int> &cubeNumbers,
+                        vector<string> &removed, string fileName);
     void     writeRow(string table, int row, double* rowptr);
+    void     writeRow(int table, int row, double* rowptr);
+    void     writeRows(string table, int firstRow, int nRows, double* data);
+    void     writeRows(int table, int firstRow, int nRows, double* data);
+    void     writeLookup(string name, vector<int> &zones, const char *dim);
+    void     writeStats(int table, TableStats &stats);
+    void     writeContentHash(int table, string hash);   // and WRITE_SETTINGS
+    string   getContentHash(string table);
+    string   getWriteSettings(string table);
+    string   describeWriteOptions(string table);   // what a new table would get
+    void     setCubeNumber(string table, int number);
+    int      getBlockRows();
+    long long getZeroChunks();
+    int      getScaleOffsetDigits(int table);
+    double   getScaleOffsetError(int table);
+    bool     canEncode();
+    bool     encodeRows(int table, int firstRow, int nRows, double* data, EncodedRows &out);
+    void     writeEncoded(int table, EncodedRows &enc);
+    bool     usesHDF5();
 
     //Nested exception classes
     class    FileOpenException { };
@@ -65,21 +228,58 @@ public:
     int      _mode;
     bool     _fileOpen;
 
-    string   _tableName[MAX_TABLES+1];
-    
-    map<string,int> _tableLookup;
-    map<string,hid_t> _dataset;
-    map<string,hid_t> _dataspace;
+    vector<OMXTable> _tables;           // [1.._nTables], by table number
+    map<string,int> _tableLookup;       // name -> table number
 
 private:
 
     hid_t    _memspace;
+    hid_t    _blockspace;
+    int      _blockspaceRows;
+    int      _chunkRows;
+    int      _chunkCols;
+    OMXWriteOptions _options;
+    OMXCacheOptions _cache;
+
+    ThreadPool* _pool;                  // parallel chunk compression, or NULL
+    CellCache* _cells;                  // getValue() cache, or NULL
+    EncodedRows _encoded;               // scratch for writeRows()
+
+    vector<OMXStorage> _storage;        // per table number, for new tables
+    vector<int> _digits;                // scale-offset digits, or -1
+    vector<double> _soError;            // max scale-offset error so far
+    vector<char> _convertBuf;
+    vector<int> _sparseCols;            // scratch for sparse reads
+    vector<double> _sparseValues;
+    long long _zeroChunks;              // all-zero chunk writes skipped
 
     //Methods
     void    readTableNames();
     void    printErrorCode(int error);
     void    init_tables (vector<string> &tableNames);
+    void    resolveTable(string table, OMXStorage &storage, int &digits, bool &sparse, bool notes);
+    string  getStringAttribute(string path, const char *name);
+    void    choose_chunks();
+    void    create_pool();
+    void    deleteTable(string table);
+    void    orderTables(vector<string> &order);
+    bool    canWriteDirect(int firstRow, int nRows);
+    bool    writeNonzeroChunks(int table, int firstRow, int nRows, hid_t memspace,
+                               hid_t memtype, void *buf, double *data);
+    void*   toStorage(int table, double* data, size_t n, hid_t &memtype);
+    hid_t   create_plist(int table);
+    hid_t   create_fapl();
+    hid_t   create_dapl(hsize_t chunkRows, hsize_t chunkCols, size_t elemSize);
+    void    trackScaleOffsetError(int table, int firstRow, int nRows, double* data);
     hid_t   openDataset(string table);  // throws InvalidOperationException
+    void    createSparse(int table, string path);
+    void    openSparse(OMXTable &tb);
+    void    appendSparse(int table, int row, double *rowdata);
+    void    flushSparse(int table);
+    void    finishSparse(int table);
+    void    readSparse(OMXTable &tb, int firstRow, int nRows, int firstCol, int nCols, double *data);
+    int     tableNumber(string table);  // throws NoSuchTableException
+    OMXTable& handle(int table);        // throws NoSuchTableException
 };
 
 #endif /* OMXMATRIX_H */
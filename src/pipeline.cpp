@@ -0,0 +1,305 @@
+/* pipeline.cpp
+ *
+ * Staged conversion pipeline behind copy_data().
+ *
+ */
+
+#include <cstdio>
+#include <thread>
+
+#include "pipeline.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// ###########################################################################
+// BlockQueue
+// ---------------------------------------------------------------------------
+
+BlockQueue::BlockQueue() {
+    _closed = false;
+}
+
+void BlockQueue::push(RowBlock *block) {
+    {
+        lock_guard<mutex> lk(_lock);
+        _items.push_back(block);
+    }
+    _ready.notify_one();
+}
+
+bool BlockQueue::pop(RowBlock* &block, double &waited) {
+    Clock::time_point start = Clock::now();
+
+    unique_lock<mutex> lk(_lock);
+    _ready.wait(lk, [this]{ return _closed || !_items.empty(); });
+    waited += secondsSince(start);
+
+    if (_items.empty()) return false;
+
+    block = _items.front();
+    _items.pop_front();
+    return true;
+}
+
+void BlockQueue::close() {
+    {
+        lock_guard<mutex> lk(_lock);
+        _closed = true;
+    }
+    _ready.notify_all();
+}
+
+// ###########################################################################
+// Stages
+// ---------------------------------------------------------------------------
+
+struct PipelineRun {
+    MatrixSource *src;
+    MatrixSink   *dst;
+    int      zones;         // rows to copy
+    int      cols;          // values per row: the source's getZones()
+    int      tables;
+    int      blockRows;
+    int      depth;
+    bool     readBlocks;    // source reads whole blocks with getRows()
+    bool     writeBlocks;   // sink writes whole blocks with writeRows()
+    vector<int> *order;
+    PipelineOptions *options;
+};
+
+static void readBlock(PipelineRun &run, RowBlock &block, int firstRow) {
+    block.firstRow = firstRow;
+    block.nRows = min(run.blockRows, run.zones - firstRow + 1);
+    block.cols = run.cols;
+
+    if (run.readBlocks) {
+        for (int t=1; t<=run.tables; t++) {
+            try {
+                run.src->getRows((*run.order)[t-1], firstRow, block.nRows, block.rows(t));
+            } catch (...) {
+                fprintf(stderr, "ERROR: Can't read table rows %d-%d in table %d!\n",
+                        firstRow, firstRow+block.nRows-1, (*run.order)[t-1]);
+                exit(2);
+            }
+        }
+        return;
+    }
+
+    // Row-at-a-time sources see rows in file order: every table's row 1, then row 2...
+    for (int r=0; r<block.nRows; r++) {
+        int row = firstRow + r;
+        for (int t=1; t<=run.tables; t++) {
+            try {
+                run.src->getRow((*run.order)[t-1], row, block.rows(t) + (size_t)r*block.cols);
+            } catch (...) {
+                fprintf(stderr, "ERROR: Can't read table row %d in table %d!\n", row, (*run.order)[t-1]);
+                exit(2);
+            }
+        }
+    }
+}
+
+void SinkTap::apply(RowBlock &block) {
+    for (int t=1; t<=_tables; t++) {
+        _sink->writeRows(t, block.firstRow, block.nRows, block.rows(t));
+    }
+}
+
+static void transformBlock(PipelineRun &run, RowBlock &block) {
+    for (unsigned int i=0; i<run.options->transforms.size(); i++) {
+        run.options->transforms[i]->apply(block);
+    }
+}
+
+static void encodeBlock(PipelineRun &run, RowBlock &block) {
+    for (int t=1; t<=run.tables; t++) {
+        EncodedRows &enc = block.encodedRows[t-1];
+        if (!run.dst->encodeRows(t, block.firstRow, block.nRows, block.rows(t), enc)) {
+            enc.nRows = 0;
+        }
+    }
+}
+
+static void writeBlock(PipelineRun &run, RowBlock &block) {
+    // Row-at-a-time sinks get rows in file order, however big the block
+    if (!run.writeBlocks) {
+        for (int r=0; r<block.nRows; r++) {
+            for (int t=1; t<=run.tables; t++) {
+                run.dst->writeRow(t, block.firstRow + r, block.rows(t) + (size_t)r*block.cols);
+            }
+        }
+    } else {
+        for (int t=1; t<=run.tables; t++) {
+            EncodedRows &enc = block.encodedRows[t-1];
+            if (enc.nRows > 0) {
+                run.dst->writeEncoded(t, enc);
+                enc.nRows = 0;
+            } else {
+                run.dst->writeRows(t, block.firstRow, block.nRows, block.rows(t));
+            }
+        }
+    }
+
+    int lastRow = block.firstRow + block.nRows - 1;
+    printf("\r%d tables:  zone %d     ", run.tables, lastRow);
+}
+
+static void printStages(vector<StageTimes*> &stages, PipelineRun &run, bool threaded) {
+    printf("Pipeline: %d blocks of %d rows, %s\n", run.depth, run.blockRows,
+           threaded ? "threaded" : "single thread");
+    for (unsigned int i=0; i<stages.size(); i++) {
+        printf("  %-10s busy %8.2fs   starved %8.2fs   blocked %8.2fs\n", stages[i]->name.c_str(),
+               stages[i]->busy, stages[i]->starved, stages[i]->blocked);
+    }
+}
+
+// ###########################################################################
+// copy_data
+// ---------------------------------------------------------------------------
+
+/*
+ * Copy rows 1..zones of every table from source to sink.  Sink table t is
+ * filled from source table order[t-1].  Rows are src->getZones() long, which
+ * differs from zones for a ZoneSubset window.  Rows go to the sink in
+ * blocks of getBlockRows(), through the stages described in pipeline.h.
+ */
+int copy_data(MatrixSource *src, MatrixSink *dst, int zones, int tables,
+              vector<int> &order, PipelineOptions &options) {
+
+    PipelineRun run;
+    run.src = src;
+    run.dst = dst;
+    run.zones = zones;
+    run.cols = src->getZones();
+    run.tables = tables;
+    run.order = &order;
+    run.options = &options;
+
+    // The sink's block size wins, since it may have to be whole chunks;
+    // a row-at-a-time sink lets the source choose
+    run.writeBlocks = dst->getBlockRows() > 1;
+    run.readBlocks = src->getReadBlockRows() > 1;
+    run.blockRows = run.writeBlocks ? dst->getBlockRows() : src->getReadBlockRows();
+    if (run.blockRows < 1) run.blockRows = 1;
+    if (run.blockRows > zones) run.blockRows = zones;
+
+    int nBlocks = (zones + run.blockRows - 1) / run.blockRows;
+    int depth = min(options.depth, nBlocks);
+    if (depth < 1) depth = 1;
+    run.depth = depth;
+
+    // Two HDF5 backends can't run side by side in a non-thread-safe HDF5
+    bool threaded = options.threaded && depth > 1 && !(src->usesHDF5() && dst->usesHDF5());
+    bool doTransform = !options.transforms.empty();
+    bool doEncode = dst->canEncode();
+
+    // Each table gets a spare row after its block, so that a source writing
+    // slightly past nZones only ever touches rows not yet read
+    vector<RowBlock> blocks(depth);
+    for (int b=0; b<depth; b++) {
+        blocks[b].stride = (size_t)(run.blockRows+1) * run.cols;
+        blocks[b].data.resize(tables * blocks[b].stride + 3);
+        blocks[b].encodedRows.resize(tables);
+        for (int t=0; t<tables; t++) blocks[b].encodedRows[t].nRows = 0;
+    }
+
+    StageTimes readTimes("read"), transformTimes("transform"), encodeTimes("encode"), writeTimes("write");
+    vector<StageTimes*> stages;
+    stages.push_back(&readTimes);
+    if (doTransform) stages.push_back(&transformTimes);
+    if (doEncode) stages.push_back(&encodeTimes);
+    stages.push_back(&writeTimes);
+
+    printf("\n");
+
+    if (!threaded) {
+        // Same stages, one block at a time on this thread
+        RowBlock &block = blocks[0];
+        for (int firstRow=1; firstRow<=zones; firstRow+=run.blockRows) {
+            Clock::time_point start = Clock::now();
+            readBlock(run, block, firstRow);
+            readTimes.busy += secondsSince(start);
+
+            if (doTransform) {
+                start = Clock::now();
+                transformBlock(run, block);
+                transformTimes.busy += secondsSince(start);
+            }
+            if (doEncode) {
+                start = Clock::now();
+                encodeBlock(run, block);
+                encodeTimes.busy += secondsSince(start);
+            }
+
+            start = Clock::now();
+            writeBlock(run, block);
+            writeTimes.busy += secondsSince(start);
+        }
+
+    } else {
+        // One queue in front of every stage; the read stage takes free blocks
+        BlockQueue freeBlocks;
+        vector<BlockQueue*> queues;
+        for (unsigned int i=1; i<stages.size(); i++) queues.push_back(new BlockQueue());
+
+        for (int b=0; b<depth; b++) freeBlocks.push(&blocks[b]);
+
+        vector<thread> threads;
+
+        // read stage
+        threads.push_back(thread([&]() {
+            for (int firstRow=1; firstRow<=zones; firstRow+=run.blockRows) {
+                RowBlock *block;
+                freeBlocks.pop(block, readTimes.blocked);
+
+                Clock::time_point start = Clock::now();
+                readBlock(run, *block, firstRow);
+                readTimes.busy += secondsSince(start);
+
+                queues[0]->push(block);
+            }
+            queues[0]->close();
+        }));
+
+        // transform and encode stages
+        for (unsigned int s=1; s+1<stages.size(); s++) {
+            threads.push_back(thread([&, s]() {
+                StageTimes *times = stages[s];
+                RowBlock *block;
+                while (queues[s-1]->pop(block, times->starved)) {
+                    Clock::time_point start = Clock::now();
+                    if (times == &transformTimes) transformBlock(run, *block);
+                    else encodeBlock(run, *block);
+                    times->busy += secondsSince(start);
+
+                    queues[s]->push(block);
+                }
+                queues[s]->close();
+            }));
+        }
+
+        // write stage, on this thread
+        RowBlock *block;
+        while (queues.back()->pop(block, writeTimes.starved)) {
+            Clock::time_point start = Clock::now();
+            writeBlock(run, *block);
+            writeTimes.busy += secondsSince(start);
+
+            freeBlocks.push(block);
+        }
+
+        for (unsigned int i=0; i<threads.size(); i++) threads[i].join();
+        for (unsigned int i=0; i<queues.size(); i++) delete queues[i];
+    }
+
+    printf("\r%d tables:  zone %d     \n", tables, zones);
+    printStages(stages, run, threaded);
+
+    return 0;
+}
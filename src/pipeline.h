@@ -0,0 +1,111 @@
+/* pipeline.h
+ *
+ * Staged conversion pipeline behind copy_data().
+ *
+ * Row blocks flow through up to four stages connected by bounded queues:
+ *
+ *   read       source getRows() into a block of rows for every table
+ *   transform  optional BlockTransforms, in order
+ *   encode     sink-specific encoding, e.g. parallel chunk compression
+ *   write      sink writeEncoded() / writeRows()
+ *
+ * A fixed number of blocks (the pipeline depth) circulates between the
+ * stages, which bounds memory.  Each stage records how long it was busy
+ * and how long it stalled waiting on its neighbours.
+ */
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "matrixio.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#define  DEFAULT_PIPELINE_DEPTH  3
+
+// Rows firstRow .. firstRow+nRows-1 of every table, each table's rows packed
+// <cols> apart, tables <stride> apart.
+struct RowBlock {
+    int      firstRow;
+    int      nRows;
+    int      cols;
+    size_t   stride;
+    vector<double> data;
+
+    vector<EncodedRows> encodedRows;   // per table from the encode stage;
+                                       // nRows 0 = write with writeRows()
+
+    double*  rows(int table) { return &data[(table-1)*stride]; }
+};
+
+// Optional per-block processing between the read and encode stages
+class BlockTransform {
+public:
+    virtual          ~BlockTransform() {}
+    virtual void     apply(RowBlock &block) = 0;
+};
+
+// Copies every block, as it passes, to a second sink: e.g. a dense export
+// written alongside the main output.  Sees the data as left by the
+// transforms ahead of it.
+class SinkTap : public BlockTransform {
+public:
+    SinkTap(MatrixSink *sink, int tables) : _sink(sink), _tables(tables) {}
+
+    void     apply(RowBlock &block);
+    MatrixSink* getSink() { return _sink; }
+
+private:
+    MatrixSink *_sink;
+    int      _tables;
+};
+
+struct PipelineOptions {
+    int      depth;        // blocks in flight
+    bool     threaded;     // run stages on their own threads
+    vector<BlockTransform*> transforms;
+
+    PipelineOptions() : depth(DEFAULT_PIPELINE_DEPTH), threaded(true) {}
+};
+
+// Busy/stall accounting for one stage, in seconds
+struct StageTimes {
+    string   name;
+    double   busy;
+    double   starved;      // waiting for input
+    double   blocked;      // waiting for a free block
+
+    StageTimes(string n) : name(n), busy(0), starved(0), blocked(0) {}
+};
+
+/*
+ * Queue of blocks between two stages.  It needs no capacity of its own,
+ * since only <depth> blocks exist.  pop() waits for data and returns false
+ * once the queue is closed and empty.
+ */
+class BlockQueue {
+public:
+    BlockQueue();
+
+    void     push(RowBlock *block);
+    bool     pop(RowBlock* &block, double &waited);
+    void     close();
+
+private:
+    deque<RowBlock*> _items;
+    mutex    _lock;
+    condition_variable _ready;
+    bool     _closed;
+};
+
+int copy_data(MatrixSource *src, MatrixSink *dst, int zones, int tables,
+              vector<int> &order, PipelineOptions &options);
+
+#endif /* PIPELINE_H */
@@ -0,0 +1,33 @@
+/* stats.cpp
+ *
+ * Summary statistics from the conversion pipeline.
+ *
+ */
+
+#include "stats.h"
+
+using namespace std;
+
+StatsCollector::StatsCollector(int tables, int rows, int cols) {
+    _stats.resize(tables);
+    for (int t=0; t<tables; t++) {
+        _stats[t].rowSums.assign(rows, 0.0);
+        _stats[t].colSums.assign(cols, 0.0);
+    }
+}
+
+void StatsCollector::apply(RowBlock &block) {
+    for (unsigned int t=1; t<=_stats.size(); t++) {
+        TableStats &st = _stats[t-1];
+        double *rows = block.rows(t);
+
+        for (int r=0; r<block.nRows; r++) {
+            st.rowSums[block.firstRow-1 + r] =
+                scanRow(rows + (size_t)r*block.cols, block.cols, st.values, &st.colSums[0]);
+        }
+    }
+}
+
+TableStats& StatsCollector::getStats(int table) {
+    return _stats[table-1];
+}
@@ -0,0 +1,35 @@
+/* stats.h
+ *
+ * Per-table summary statistics, gathered from row blocks as they pass
+ * through the conversion pipeline, so nobody needs a second pass later.
+ */
+#include <vector>
+
+#include "pipeline.h"
+#include "kernels.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef STATS_H
+#define STATS_H
+
+struct TableStats {
+    ValueStats values;              // finite values; NaN and Inf counted
+    vector<double> rowSums;         // per origin
+    vector<double> colSums;         // per destination
+};
+
+// A transform that only looks: statistics of every table, in sink order
+class StatsCollector : public BlockTransform {
+public:
+    StatsCollector(int tables, int rows, int cols);
+
+    void     apply(RowBlock &block);
+    TableStats& getStats(int table);
+
+private:
+    vector<TableStats> _stats;
+};
+
+#endif /* STATS_H */
@@ -0,0 +1,52 @@
+/* tablehash.cpp
+ *
+ * Per-table content hashes.
+ *
+ */
+
+#include <cstdio>
+
+#include "tablehash.h"
+
+using namespace std;
+
+// ###########################################################################
+// TableHashes:  a hash of each table written to it
+// ---------------------------------------------------------------------------
+
+TableHashes::TableHashes(int tables, int rows, int cols) {
+    _nTables = tables;
+    _nRows = rows;
+    _nCols = cols;
+    _sums.assign(tables, 0);
+}
+
+// Row length: rows arrive getZones() values apart, one per destination
+int TableHashes::getZones() {
+    return _nCols;
+}
+
+// Blocks of a few MB rather than single rows, to keep pipeline overhead down
+int TableHashes::getBlockRows() {
+    long long rowBytes = (long long)_nCols * _nTables * sizeof(double);
+    long long rows = HASH_BLOCK_BYTES / (rowBytes > 0 ? rowBytes : 1);
+    if (rows < 1) rows = 1;
+    if (rows > _nRows) rows = _nRows;
+    return (int) rows;
+}
+
+void TableHashes::writeRow(int table, int row, double *rowptr) {
+    _sums[table-1] += hashValues(rowptr, _nCols, row);
+}
+
+void TableHashes::closeFile() {
+}
+
+string TableHashes::getHash(int table) {
+    double shape[2] = { (double)_nRows, (double)_nCols };
+    unsigned long long h = hashValues(shape, 2, _sums[table-1]);
+
+    char hex[17];
+    sprintf(hex, "%016llx", h);
+    return hex;
+}
@@ -0,0 +1,44 @@
+/* tablehash.h
+ *
+ * Content hashes of whole tables, so an incremental conversion can tell
+ * which tables changed since the output was last written.
+ *
+ * TableHashes is a sink: copy_data() into it for a hashing pass of its
+ * own, or put it behind a SinkTap to hash rows on their way to another
+ * sink.  Each row is hashed with its row number as the seed and the row
+ * hashes are added up, so blocks may arrive in any order.
+ */
+#include <string>
+#include <vector>
+
+#include "matrixio.h"
+#include "kernels.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef TABLEHASH_H
+#define TABLEHASH_H
+
+#define  HASH_BLOCK_BYTES  (4*1024*1024)    // rows per block, across all tables
+
+class TableHashes : public MatrixSink {
+public:
+    TableHashes(int tables, int rows, int cols);
+
+    int      getZones();
+    int      getBlockRows();
+    void     writeRow(int table, int row, double *rowptr);
+    void     closeFile();
+
+    // 16 hex digits, covering the table's shape and every value's bits
+    string   getHash(int table);
+
+private:
+    int      _nRows;
+    int      _nCols;
+    int      _nTables;
+    vector<unsigned long long> _sums;
+};
+
+#endif /* TABLEHASH_H */
@@ -0,0 +1,94 @@
+/* threadpool.cpp
+ *
+ * Minimal fixed-size worker pool with a blocking parallel-for.
+ *
+ */
+
+#include "threadpool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool(int threads) {
+    _task = NULL;
+    _nTasks = 0;
+    _next = 0;
+    _finished = 0;
+    _generation = 0;
+    _quit = false;
+
+    if (threads < 1) threads = defaultThreads();
+
+    // The caller works too, so start one thread fewer
+    for (int i=1; i<threads; i++) {
+        _workers.push_back(thread(&ThreadPool::worker, this));
+    }
+}
+
+//Destructor
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lk(_lock);
+        _quit = true;
+    }
+    _wake.notify_all();
+
+    for (unsigned int i=0; i<_workers.size(); i++) {
+        _workers[i].join();
+    }
+}
+
+int ThreadPool::defaultThreads() {
+    int n = thread::hardware_concurrency();
+    return (n < 1) ? 1 : n;
+}
+
+int ThreadPool::getThreads() {
+    return _workers.size() + 1;
+}
+
+void ThreadPool::run(int nTasks, const function<void(int)> &task) {
+    if (nTasks <= 0) return;
+
+    unique_lock<mutex> lk(_lock);
+    _task = &task;
+    _nTasks = nTasks;
+    _next = 0;
+    _finished = 0;
+    _generation++;
+    _wake.notify_all();
+
+    drain(lk);
+
+    _done.wait(lk, [this]{ return _finished == _nTasks; });
+    _task = NULL;
+}
+
+// ---- Private functions ---------------------------------------------------
+
+// Take tasks until none are left.  Called with the lock held.
+void ThreadPool::drain(unique_lock<mutex> &lk) {
+    while (_next < _nTasks) {
+        int i = _next++;
+        const function<void(int)> *task = _task;
+
+        lk.unlock();
+        (*task)(i);
+        lk.lock();
+
+        if (++_finished == _nTasks) _done.notify_all();
+    }
+}
+
+void ThreadPool::worker() {
+    long seen = 0;
+
+    unique_lock<mutex> lk(_lock);
+    while (true) {
+        _wake.wait(lk, [&]{ return _quit || _generation != seen; });
+        if (_quit) return;
+
+        seen = _generation;
+        drain(lk);
+    }
+}
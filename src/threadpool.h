@@ -0,0 +1,50 @@
+/* threadpool.h
+ *
+ * Minimal fixed-size worker pool with a blocking parallel-for.
+ *
+ * Tasks must not call into HDF5: the library is not thread-safe, so all
+ * H5 calls stay on the thread that owns the file.
+ */
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+class ThreadPool {
+public:
+    ThreadPool(int threads);   // threads < 1: one per core
+    virtual  ~ThreadPool();
+
+    int      getThreads();
+
+    // Run task(0) .. task(nTasks-1) across the pool, including the calling
+    // thread, and return when every task has finished.
+    void     run(int nTasks, const function<void(int)> &task);
+
+    static int defaultThreads();
+
+private:
+    vector<thread> _workers;
+    mutex    _lock;
+    condition_variable _wake;
+    condition_variable _done;
+
+    const function<void(int)> *_task;
+    int      _nTasks;
+    int      _next;
+    int      _finished;
+    long     _generation;
+    bool     _quit;
+
+    void     worker();
+    void     drain(unique_lock<mutex> &lk);
+};
+
+#endif /* THREADPOOL_H */
@@ -10,6 +10,7 @@
 #include "tppmatrix.h"
 #include <time.h>
 #include <limits.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -91,9 +92,11 @@ TPPMatrix::TPPMatrix()
 	_nTables = 0;
 	_nZones = 0;
 	_mode = 0;
-
-    for (int i=0; i < MAX_TABLES; i++)
-        _rowPos[i] = NULL;
+    _cells = NULL;
+    _useIndexFile = true;
+    _indexedRows = 0;
+    _scanPos = 0;
+    _scanDone = false;
 }
 
 //Destructor
@@ -101,6 +104,7 @@ TPPMatrix::~TPPMatrix()
 {
     _fileOpen = false;
 
+    delete _cells;
     free(_rowptr);
     free(_matlist->buffer);
 }
@@ -108,11 +112,21 @@ TPPMatrix::~TPPMatrix()
 
 //--------------------------------------------------------------------
 
-void TPPMatrix::openFile(char *fileName)
+void TPPMatrix::setIndexFile(bool use)
+{
+    _useIndexFile = use;
+}
+
+
+//--------------------------------------------------------------------
+//Reading a row needs its file position, and finding those means walking
+//every row header.  The positions are saved to an .idx sidecar, so later
+//opens skip the walk.  A lazy open walks only as far as the rows read.
+//
+void TPPMatrix::openFile(char *fileName, bool lazy)
 {
 
 	int i=0;
-    int table, origin;
     char *pLicenseFile=NULL;
 
  	i=pf_FileInquire(fileName, &_matlist);
@@ -160,21 +174,42 @@ void TPPMatrix::openFile(char *fileName)
 
 
     readTableNames();
+    _rowPos.assign((size_t)_nTables * _nZones, -1);
+
+    _fileName = fileName;
+    _indexedRows = 0;
+    _scanPos = 0;
+    _scanDone = false;
+
+    if (_useIndexFile && loadIndexFile()) return;
+    if (!lazy) indexRows(_nZones);
+}
+
+
+//--------------------------------------------------------------------
+//Store row locations until every row up to lastRow is known.  Rows are
+//stored by origin, so seeing a later origin means lastRow is complete.
+//
+void TPPMatrix::indexRows(int lastRow)
+{
+    int table, origin;
+
+    if (_scanDone || lastRow <= _indexedRows) return;
+
+    if (pf_TppMatPos(_matlist, _scanPos)==0) {
+        cout << "**TPPMatrix: Could not position file, " << _fileName << endl;
+        throw MatrixReadException();
+    }
 
-    //Store row locations
     while ( pf_TppMatReadNext(1, _matlist, _rowptr)!=0 ) {
         table  = _matlist->rowMat;
         origin = _matlist->rowOrg;
 
-        if (table > MAX_TABLES) {
-            cout << "**TPPMatrix: More than 500 tables in matrix" << endl;
+        if (table>_nTables || table<=0) {
+            cout << "**TPPMatrix: Read table "<<table<<" but matrix has "<<_nTables<<" tables" << endl;
             throw MatrixReadException();
         }
 
-        if (_rowPos[table] == NULL) {
-            _rowPos[table] = (DWORD *) malloc ((_matlist->zones+3) * sizeof(DWORD));
-        }
-
 		if(origin>_matlist->zones || origin<=0){
             cout << "**TPPMatrix: Read zone "<<origin<<" which is greater than "<<_matlist->zones<<" in matrix" << endl;
             throw MatrixReadException();
@@ -185,8 +220,90 @@ void TPPMatrix::openFile(char *fileName)
 		     throw MatrixReadException();
 		}
 
-        _rowPos[table][origin] = _matlist->rowpos;
+        rowPos(table, origin) = _matlist->rowpos;
         pf_TppMatReadNext(-2, _matlist, _rowptr);
+
+        _indexedRows = origin - 1;
+        if (origin > lastRow) {
+            _scanPos = pf_TppMatGetPos(_matlist);
+            return;
+        }
+    }
+
+    _scanDone = true;
+    _indexedRows = _nZones;
+    if (_useIndexFile) saveIndexFile();
+}
+
+
+//--------------------------------------------------------------------
+//Load the sidecar index, if it exists and matches this file
+//
+bool TPPMatrix::loadIndexFile()
+{
+    struct _stat64 st;
+    if (_stat64(_fileName.c_str(), &st) != 0) return false;
+
+    string indexName = _fileName + INDEX_EXT;
+    FILE *f = fopen(indexName.c_str(), "rb");
+    if (f == NULL) return false;
+
+    char magic[INDEX_MAGIC_LEN];
+    long long size, mtime;
+    int zones, tables;
+
+    bool ok = fread(magic, 1, INDEX_MAGIC_LEN, f) == INDEX_MAGIC_LEN
+           && memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_LEN) == 0
+           && fread(&size, sizeof(size), 1, f) == 1 && size == (long long) st.st_size
+           && fread(&mtime, sizeof(mtime), 1, f) == 1 && mtime == (long long) st.st_mtime
+           && fread(&zones, sizeof(zones), 1, f) == 1 && zones == _nZones
+           && fread(&tables, sizeof(tables), 1, f) == 1 && tables == _nTables;
+
+    // Same layout as _rowPos
+    ok = ok && fread(&_rowPos[0], sizeof(long long), _rowPos.size(), f) == _rowPos.size();
+    fclose(f);
+
+    if (!ok) {
+        _rowPos.assign(_rowPos.size(), -1);
+    } else {
+        _scanDone = true;
+        _indexedRows = _nZones;
+    }
+    return ok;
+}
+
+
+//--------------------------------------------------------------------
+//Save the complete index.  Written under a temporary name and renamed,
+//so a reader never sees half a file; failures (read-only folders) are
+//ignored, since the index can always be rebuilt.
+//
+void TPPMatrix::saveIndexFile()
+{
+    struct _stat64 st;
+    if (_stat64(_fileName.c_str(), &st) != 0) return;
+
+    string indexName = _fileName + INDEX_EXT;
+    string tempName = indexName + ".tmp";
+    FILE *f = fopen(tempName.c_str(), "wb");
+    if (f == NULL) return;
+
+    long long size = st.st_size;
+    long long mtime = st.st_mtime;
+
+    bool ok = fwrite(INDEX_MAGIC, 1, INDEX_MAGIC_LEN, f) == INDEX_MAGIC_LEN
+           && fwrite(&size, sizeof(size), 1, f) == 1
+           && fwrite(&mtime, sizeof(mtime), 1, f) == 1
+           && fwrite(&_nZones, sizeof(_nZones), 1, f) == 1
+           && fwrite(&_nTables, sizeof(_nTables), 1, f) == 1;
+
+    ok = ok && fwrite(&_rowPos[0], sizeof(long long), _rowPos.size(), f) == _rowPos.size();
+
+    if (fclose(f) != 0) ok = false;
+
+    remove(indexName.c_str());
+    if (!ok || rename(tempName.c_str(), indexName.c_str()) != 0) {
+        remove(tempName.c_str());
     }
 }
 
@@ -196,15 +313,11 @@ void TPPMatrix::readTableNames()
 {
 
     //Store table names
-    char tempbuf[255];
     char* c = (char *) _matlist->Mnames;
 
+    _tableName.assign(1, "");
     for (int i=1; i <= _matlist->mats; i++) {
-
-        sprintf (tempbuf, "%s", c);
-        _tableName[i] = (char *) malloc( (strlen(tempbuf)+1) *sizeof(char));
-
-        strcpy (_tableName[i], tempbuf);
+        _tableName.push_back(c);
         c = c + strlen(c) + 1;
     }
 }
@@ -212,11 +325,11 @@ void TPPMatrix::readTableNames()
 
 //--------------------------------------------------------------------
 //
-char* TPPMatrix::getTableName(int table)
+string TPPMatrix::getTableName(int table)
 {
 
-    char* c = "";
-	if (table >= MAX_TABLES || table < 0)
+    string c = "";
+	if (table > _nTables || table < 1)
         c = "";
     else
         c = _tableName[table];
@@ -251,13 +364,19 @@ int TPPMatrix::getZones(void)
 
 void TPPMatrix::getRow(int table, int row, double *rowptr)
 {
+    if (table < 1 || table > _nTables || row < 1 || row > _nZones) {
+        cout << "**TPPMatrix: No table=" << table << " row=" << row << endl;
+        throw MatrixReadException();
+    }
+
+    if (row > _indexedRows) indexRows(row);
 
-    if (_rowPos[table] == NULL) {
-        cout << "**TPPMatrix: Table=" << table << " not indexed" << endl;
+    if (rowPos(table, row) < 0) {
+        cout << "**TPPMatrix: Table=" << table << " row=" << row << " not indexed" << endl;
         throw MatrixReadException();
     }
 
-    if (! pf_TppMatReadDirect (_matlist, _rowPos[table][row], rowptr) ) {
+    if (! pf_TppMatReadDirect (_matlist, (DWORD) rowPos(table, row), rowptr) ) {
         cout << "**TPPMatrix: Could not read table=" << table << " row=" << row << endl;
         throw MatrixReadException();
     }
@@ -265,26 +384,27 @@ void TPPMatrix::getRow(int table, int row, double *rowptr)
 
 
 //--------------------------------------------------------------------
+//Cell j of a row, both numbered from 1.  Rows come from the row index
+//through an LRU cache, instead of re-scanning the file for every cell.
+//
 double TPPMatrix::getValue(int table, int row, int j)
 {
-    if (j < 0 || j > _nZones) {
+    if (j < 1 || j > _nZones) {
         cout << "**TPPMatrix: Could not read table=" << table <<
                 " row=" << row << " j=" << j << endl;
         throw MatrixReadException();
     }
 
-    if (!pf_TppMatPos(_matlist, 0)) {
-        cout << "**TPPMatrix: Could not postion file" << endl;
-        throw MatrixReadException();
-    }
+    if (_cells == NULL) _cells = new CellCache(this);
+    return _cells->getValue(table, row, j);
+}
 
-    if (! pf_TppMatReadSelect (_matlist, row, table, &_rowptr[1]) ) {
-        cout << "**TPPMatrix: Could not read table=" << table <<
-                " row=" << row << endl;
-        throw MatrixReadException();
-    }
 
-    return _rowptr[j];
+//--------------------------------------------------------------------
+void TPPMatrix::getValues(int table, vector< pair<int,int> > &cells, double *values)
+{
+    if (_cells == NULL) _cells = new CellCache(this);
+    _cells->getValues(table, cells, values);
 }
 
 
@@ -321,7 +441,9 @@ void TPPMatrix::createFile(int tables, int zones, const char** matName,
     for (int i=0; i<tables;i++) _matlist->Mspecs[i] = 'D';
 
 
-    for (char* b=(char*)_matlist->Mnames, i=1; i<=tables;i++)
+    // (i was a char here once, which wrapped past 127 tables)
+    char* b = (char*)_matlist->Mnames;
+    for (int i=1; i<=tables;i++)
     	b += 1 + sprintf(b,"%s",matName[i-1]);
 
 	/* Open the Op file */
@@ -372,6 +494,8 @@ void TPPMatrix::closeFile()
     if (_mode == CREATE_FILE)
         pf_TppMatClose(_matlist);
 
+    delete _cells;
+    _cells = NULL;
     _fileOpen = false;
 }
 
@@ -10,17 +10,30 @@
  */
 
 #include "cubeio.h"
+#include "cellcache.h"
+#include "matrixio.h"
 
 #include <iostream>
 #include <string>
+#include <vector>
 //#include <dir>
 
 using namespace std;
 
+#ifndef TPPMATRIX_H
+#define TPPMATRIX_H
+
 #define  CREATE_FILE  1
 #define  MAX_DLL_ATTEMPTS 5
 
-#define  MAX_TABLES  500
+// Row index sidecar, saved next to the matrix as <file>.mat.idx:
+//   char[8] magic, int64 file size, int64 file mtime, int32 zones,
+//   int32 tables, then int64 row positions for each table 1..tables,
+//   origin 1..zones (-1 = no such row).  Stale when size or mtime differ.
+#define  INDEX_MAGIC      "TPPIDX01"
+#define  INDEX_MAGIC_LEN  8
+#define  INDEX_EXT        ".idx"
+
 #define  HCHAR  char
 #define  BYTE   unsigned char
 #define  UCHAR  unsigned char
@@ -42,7 +55,7 @@ using namespace std;
 //--------------------------------------------------------------------
 //TP+ Matrix Class Definition
 
-class TPPMatrix
+class TPPMatrix : public MatrixSource, public MatrixSink
 {
 
 //--------------------------------------------------------------------
@@ -51,12 +64,14 @@ public:
     virtual  ~TPPMatrix();
 
     //Existing file operations
-    void     openFile(char *fileName);
+    void     setIndexFile(bool use);     // read/write the .idx sidecar; default on
+    void     openFile(char *fileName, bool lazy = false);
     int      getZones();
     int      getTables();
     void     getRow (int table, int row, double *rowptr);
     double   getValue(int table, int row, int j);
-    char*    getTableName(int table);
+    void     getValues(int table, vector< pair<int,int> > &cells, double *values);
+    string   getTableName(int table);
 
     //New file operations
     void     createFile(int tables, int zones, const char** matName,
@@ -82,10 +97,26 @@ private:
     int      _mode;
     bool     _fileOpen;
     double*  _rowptr;
-    char*    _tableName[MAX_TABLES+1];
-    DWORD*   _rowPos[MAX_TABLES+1];
+    CellCache* _cells;               // getValue() cache, or NULL
+    vector<string> _tableName;   // [1.._nTables]
+    vector<long long> _rowPos;   // file position of every row, table-major
+                                 // (see rowPos()); -1 until indexed
+
+    string   _fileName;
+    bool     _useIndexFile;
+    int      _indexedRows;       // rows 1.._indexedRows are in _rowPos
+    DWORD    _scanPos;           // where indexRows() carries on from
+    bool     _scanDone;
 
     //Methods
+    long long& rowPos(int table, int origin) {
+        return _rowPos[(size_t)(table-1)*_nZones + (origin-1)];
+    }
     void readTableNames();
     void printErrorCode(int error);
+    void indexRows(int lastRow);
+    bool loadIndexFile();
+    void saveIndexFile();
 };
+
+#endif /* TPPMATRIX_H */
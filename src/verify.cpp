@@ -0,0 +1,132 @@
+/* verify.cpp
+ *
+ * Cell-by-cell comparison of two matrices.
+ *
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "verify.h"
+
+using namespace std;
+
+// ###########################################################################
+// VerifySink:  compares rows written to it with another matrix
+// ---------------------------------------------------------------------------
+
+VerifySink::VerifySink(MatrixSource *other, vector<int> &order, double atol, double rtol,
+                       int threads) {
+    _other = other;
+    _order = order;
+    _nZones = other->getZones();
+    _atol = atol;
+    _rtol = rtol;
+    _pool = new ThreadPool(threads);
+    _results.resize(order.size());
+}
+
+VerifySink::~VerifySink() {
+    delete _pool;
+}
+
+int VerifySink::getZones() {
+    return _nZones;
+}
+
+// Big blocks, so each table's share splits well across the threads, made
+// of whole read blocks of the other matrix (whole chunk bands for OMX)
+int VerifySink::getBlockRows() {
+    long long rowBytes = (long long)_nZones * _order.size() * sizeof(double);
+    long long rows = VERIFY_BLOCK_BYTES / (rowBytes > 0 ? rowBytes : 1);
+
+    int band = _other->getReadBlockRows();
+    if (band < 1) band = 1;
+    rows -= rows % band;
+    if (rows < band) rows = band;
+    if (rows > _nZones) rows = _nZones;
+    return (int) rows;
+}
+
+// The other matrix is read from the write stage
+bool VerifySink::usesHDF5() {
+    return _other->usesHDF5();
+}
+
+void VerifySink::writeRow(int table, int row, double *rowptr) {
+    writeRows(table, row, 1, rowptr);
+}
+
+/*
+ * Read the same rows of the other matrix, then compare row ranges on the
+ * pool.  Each range keeps its own result; they are merged in row order so
+ * the first mismatches listed are the first in the table.
+ */
+void VerifySink::writeRows(int table, int firstRow, int nRows, double *data) {
+    _buf.resize((size_t)nRows * _nZones);
+    _other->getRows(_order[table-1], firstRow, nRows, &_buf[0]);
+
+    int tasks = min(nRows, _pool->getThreads() * 4);
+    vector<TableCompare> parts(tasks);
+
+    _pool->run(tasks, [&](int k) {
+        int r0 = (int)((long long)nRows * k / tasks);
+        int r1 = (int)((long long)nRows * (k+1) / tasks);
+        size_t offset = (size_t)r0 * _nZones;
+        compareRows(firstRow + r0, r1 - r0, data + offset, &_buf[offset], parts[k]);
+    });
+
+    TableCompare &result = _results[table-1];
+    for (int k=0; k<tasks; k++) {
+        TableCompare &part = parts[k];
+        if (part.maxDiff > result.maxDiff) {
+            result.maxDiff = part.maxDiff;
+            result.maxRow = part.maxRow;
+            result.maxCol = part.maxCol;
+        }
+        result.mismatches += part.mismatches;
+        for (unsigned int i=0; i<part.first.size() && result.first.size() < VERIFY_LIST; i++) {
+            result.first.push_back(part.first[i]);
+        }
+    }
+}
+
+// Vector compare of each row; the rare rows with a new maximum or with
+// mismatches to list are looked at again value by value
+void VerifySink::compareRows(int firstRow, int nRows, const double *expected,
+                             const double *actual, TableCompare &result) {
+    for (int r=0; r<nRows; r++) {
+        const double *a = expected + (size_t)r * _nZones;
+        const double *b = actual + (size_t)r * _nZones;
+
+        double rowMax = 0;
+        int bad = compareValues(a, b, _nZones, _atol, _rtol, rowMax);
+
+        if (rowMax > result.maxDiff) {
+            for (int j=0; j<_nZones; j++) {
+                if (fabs(a[j] - b[j]) == rowMax) {
+                    result.maxDiff = rowMax;
+                    result.maxRow = firstRow + r;
+                    result.maxCol = j+1;
+                    break;
+                }
+            }
+        }
+
+        if (bad == 0) continue;
+        result.mismatches += bad;
+        for (int j=0; j<_nZones && result.first.size() < VERIFY_LIST; j++) {
+            if (!valuesMatch(a[j], b[j], _atol, _rtol)) {
+                Mismatch m = { firstRow + r, j+1, a[j], b[j] };
+                result.first.push_back(m);
+            }
+        }
+    }
+}
+
+void VerifySink::closeFile() {
+}
+
+TableCompare& VerifySink::getResult(int table) {
+    return _results[table-1];
+}
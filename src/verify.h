@@ -0,0 +1,72 @@
+/* verify.h
+ *
+ * Check a conversion by comparing its output with its source, cell by cell.
+ *
+ * VerifySink is a sink that, for every block of rows written to it, reads
+ * the same rows from the other matrix and compares the two on a thread
+ * pool.  Nothing is written anywhere, so a check costs two reads and no
+ * compression: much less than converting again.
+ */
+#include <vector>
+
+#include "matrixio.h"
+#include "kernels.h"
+#include "threadpool.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#define  VERIFY_LIST         10                  // mismatches kept per table
+#define  VERIFY_BLOCK_BYTES  (16*1024*1024)      // rows per block, across all tables
+
+struct Mismatch {
+    int      row;
+    int      col;
+    double   expected;     // value written to the sink
+    double   actual;       // value in the other matrix
+};
+
+struct TableCompare {
+    double   maxDiff;      // largest |difference| that isn't NaN
+    int      maxRow;       // where it is, from 1; 0 if no difference
+    int      maxCol;
+    long long mismatches;  // cells outside the tolerance
+    vector<Mismatch> first;     // the first VERIFY_LIST of them, in row order
+
+    TableCompare() : maxDiff(0), maxRow(0), maxCol(0), mismatches(0) {}
+};
+
+class VerifySink : public MatrixSink {
+public:
+    // Rows of sink table t are checked against table order[t-1] of other.
+    // Cells match if within atol + rtol * |expected|.
+    VerifySink(MatrixSource *other, vector<int> &order, double atol, double rtol, int threads);
+    virtual  ~VerifySink();
+
+    int      getZones();
+    int      getBlockRows();
+    bool     usesHDF5();
+    void     writeRow(int table, int row, double *rowptr);
+    void     writeRows(int table, int firstRow, int nRows, double *data);
+    void     closeFile();
+
+    TableCompare& getResult(int table);
+
+private:
+    MatrixSource *_other;
+    vector<int> _order;
+    int      _nZones;
+    double   _atol;
+    double   _rtol;
+    ThreadPool *_pool;
+    vector<TableCompare> _results;
+    vector<double> _buf;            // the other matrix's rows
+
+    void     compareRows(int firstRow, int nRows, const double *expected,
+                         const double *actual, TableCompare &result);
+};
+
+#endif /* VERIFY_H */
@@ -0,0 +1,170 @@
+/* zonesubset.cpp
+ *
+ * Origin/destination subset of a matrix source.
+ *
+ */
+
+#include <cctype>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "zonesubset.h"
+
+using namespace std;
+
+// ###########################################################################
+// ZoneSubset:  some origins and destinations of another source
+// ---------------------------------------------------------------------------
+
+ZoneSubset::ZoneSubset(MatrixSource *source, vector<int> &origins, vector<int> &dests) {
+    _source = source;
+    _origins = origins;
+    _dests = dests;
+    _row.resize(source->getZones() + 3);
+
+    // A contiguous destination range can be read as a tile
+    _destRun = _dests.size();
+    for (unsigned int j=1; j<_dests.size(); j++) {
+        if (_dests[j] != _dests[0] + (int)j) _destRun = 0;
+    }
+}
+
+ZoneSubset::~ZoneSubset() {
+    delete _source;
+}
+
+int ZoneSubset::getOrigins() {
+    return _origins.size();
+}
+
+vector<int>& ZoneSubset::getOriginZones() {
+    return _origins;
+}
+
+vector<int>& ZoneSubset::getDestZones() {
+    return _dests;
+}
+
+int ZoneSubset::getZones() {
+    return _dests.size();
+}
+
+int ZoneSubset::getTables() {
+    return _source->getTables();
+}
+
+string ZoneSubset::getTableName(int table) {
+    return _source->getTableName(table);
+}
+
+bool ZoneSubset::usesHDF5() {
+    return _source->usesHDF5();
+}
+
+int ZoneSubset::getReadBlockRows() {
+    return _source->getReadBlockRows();
+}
+
+void ZoneSubset::closeFile() {
+    _source->closeFile();
+}
+
+void ZoneSubset::getRow(int table, int row, double *rowptr) {
+    _source->getRow(table, _origins[row-1], &_row[0]);
+    for (unsigned int j=0; j<_dests.size(); j++) {
+        rowptr[j] = _row[_dests[j]-1];
+    }
+}
+
+/*
+ * Block sources (OMX) read each run of consecutive origins, cut to a
+ * contiguous destination range, as one tile.  Anything else goes row by
+ * row, reading only the listed origins.
+ */
+void ZoneSubset::getRows(int table, int firstRow, int nRows, double *data) {
+    int cols = _dests.size();
+    bool tiles = _destRun > 0 && _source->getReadBlockRows() > 1;
+
+    for (int r=0; r<nRows; ) {
+        double *out = data + (size_t)r*cols;
+
+        if (tiles) {
+            int run = originRun(firstRow+r, nRows-r);
+            _source->getTile(table, _origins[firstRow+r-1], run, _dests[0], cols, out);
+            r += run;
+        } else {
+            getRow(table, firstRow+r, out);
+            r++;
+        }
+    }
+}
+
+bool ZoneSubset::parseZoneList(const char *text, ZoneRanges &ranges) {
+    string list;
+
+    if (text[0] == '@') {
+        FILE *f = fopen(text+1, "r");
+        if (f == NULL) {
+            fprintf(stderr, "\n** Cannot open zone list %s\n", text+1);
+            return false;
+        }
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) list.append(buf, n);
+        fclose(f);
+    } else {
+        list = text;
+    }
+
+    const char *c = list.c_str();
+    while (*c) {
+        if (*c == ',' || isspace((unsigned char)*c)) {
+            c++;
+            continue;
+        }
+
+        char *end;
+        long long first = strtoll(c, &end, 10);
+        long long last = first;
+        if (end == c) return false;
+        if (*end == '-') {
+            c = end+1;
+            last = strtoll(c, &end, 10);
+            if (end == c) return false;
+        }
+        if (first < 1 || last < first || last > INT_MAX) return false;
+
+        ranges.push_back(make_pair((int)first, (int)last));
+        c = end;
+    }
+    return !ranges.empty();
+}
+
+bool ZoneSubset::expandZoneList(ZoneRanges &ranges, int maxZone, vector<int> &zones, int &badZone) {
+    size_t count = 0;
+    for (unsigned int i=0; i<ranges.size(); i++) {
+        if (ranges[i].second > maxZone) {
+            badZone = ranges[i].second;
+            return false;
+        }
+        count += ranges[i].second - ranges[i].first + 1;
+    }
+
+    zones.clear();
+    zones.reserve(count);
+    for (unsigned int i=0; i<ranges.size(); i++) {
+        for (int z=ranges[i].first; z<=ranges[i].second; z++) zones.push_back(z);
+    }
+    return true;
+}
+
+// ---- Private functions ---------------------------------------------------
+
+// How many of rows firstRow.. (at most nRows) are consecutive origins
+int ZoneSubset::originRun(int firstRow, int nRows) {
+    int run = 1;
+    while (run < nRows && _origins[firstRow-1+run] == _origins[firstRow-1] + run) run++;
+    return run;
+}
@@ -0,0 +1,64 @@
+/* zonesubset.h
+ *
+ * A view of some origins and destinations of another matrix source, for
+ * converting a corridor or sub-area instead of the whole region.
+ *
+ * Row r of the view is origin zone origins[r-1] of the source, cut down to
+ * the destination zones in dests.  Only rows of listed origins are ever
+ * read from the source, and contiguous runs of origins and destinations
+ * go to the source as one getTile() call, which OMX reads as a single
+ * hyperslab.
+ */
+#include <string>
+#include <vector>
+
+#include "matrixio.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------
+#ifndef ZONESUBSET_H
+#define ZONESUBSET_H
+
+typedef vector< pair<int,int> > ZoneRanges;     // first, last zone, inclusive
+
+class ZoneSubset : public MatrixSource {
+public:
+    // Zone numbers are from 1, in the order the view should have them.
+    // The subset takes over the source, and deletes it.
+    ZoneSubset(MatrixSource *source, vector<int> &origins, vector<int> &dests);
+    virtual  ~ZoneSubset();
+
+    int      getOrigins();
+    vector<int>& getOriginZones();
+    vector<int>& getDestZones();
+    int      getZones();            // row length: the number of destinations
+    int      getTables();
+    string   getTableName(int table);
+    void     getRow(int table, int row, double *rowptr);
+    void     getRows(int table, int firstRow, int nRows, double *data);
+    int      getReadBlockRows();
+    bool     usesHDF5();
+    void     closeFile();           // closes the source, too
+
+    // Parse "1-100,205,300-310" or "@file" (numbers and ranges, separated
+    // by commas or whitespace).  Returns false on a syntax error.  Ranges
+    // are kept as they are until expandZoneList(), when the zone count is
+    // known, so a typo can't run to billions of zones.
+    static bool parseZoneList(const char *text, ZoneRanges &ranges);
+
+    // The zones of ranges, in order.  Returns false, with the last zone
+    // of the first range past maxZone in badZone, if any zone is.
+    static bool expandZoneList(ZoneRanges &ranges, int maxZone, vector<int> &zones, int &badZone);
+
+private:
+    MatrixSource *_source;
+    vector<int> _origins;
+    vector<int> _dests;
+    int      _destRun;              // dests are _dests[0].._dests[0]+_destRun-1, or 0
+    vector<double> _row;            // one full source row
+
+    int      originRun(int firstRow, int nRows);
+};
+
+#endif /* ZONESUBSET_H */